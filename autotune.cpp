@@ -0,0 +1,149 @@
+// Перебирает размеры, селективность и диапазон значений, замеряет все алгоритмы
+// и пишет профиль с таблицей решений для IntersectionCostModel.
+//
+// Запуск: ./out/autotune [--out profile.txt] [--max-log-smaller 16] [--max-log-ratio 10]
+//                        [--max-log-larger 22] [--repetitions 3]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "count_intersection.hpp"
+
+struct AutotuneOptions {
+    string out = "out/intersection_profile.txt";
+    int max_log_smaller = 16;
+    int max_log_ratio = 10;
+    int max_log_larger = 22;
+    int repetitions = 3;
+};
+
+// Чтобы не ждать часами, by_find не замеряем там, где он заведомо проигрывает.
+const double MAX_FIND_COMPARES = 1 << 27;
+
+// Доли элементов larger, которые есть в smaller. Заранее доля неизвестна,
+// поэтому в таблицу идет алгоритм с наименьшим суммарным временем по всем долям.
+const double SELECTIVITIES[] = {0.0, 0.1, 0.5, 1.0};
+
+// Диапазон значений для каждого класса IntersectionCostModel::span_class.
+uint32_t span_for_class(int span_cls, size_t smaller_size) {
+    switch (span_cls) {
+        case 0: return 2 * smaller_size;
+        case 1: return 32 * smaller_size;
+        default: return UINT32_MAX;
+    }
+}
+
+vector<int> random_values(mt19937 &gen, size_t size, uint32_t span) {
+    uniform_int_distribution<uint32_t> uid(0, span);
+    vector<int> res(size);
+    for (auto &e : res) {
+        e = (int)(uid(gen) + (uint32_t)INT32_MIN);
+    }
+    return res;
+}
+
+vector<int> larger_with_selectivity(mt19937 &gen, const vector<int> &smaller, size_t size,
+                                    uint32_t span, double selectivity) {
+    vector<int> res = random_values(gen, size, span);
+    uniform_int_distribution<size_t> pick(0, smaller.size() - 1);
+    bernoulli_distribution hit(selectivity);
+    for (auto &e : res) {
+        if (hit(gen)) {
+            e = smaller[pick(gen)];
+        }
+    }
+    return res;
+}
+
+bool parse_options(int argc, char **argv, AutotuneOptions &options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 == argc) {
+            return false;
+        }
+        const char *value = argv[++i];
+        if (arg == "--out") {
+            options.out = value;
+        } else if (arg == "--max-log-smaller") {
+            options.max_log_smaller = atoi(value);
+        } else if (arg == "--max-log-ratio") {
+            options.max_log_ratio = atoi(value);
+        } else if (arg == "--max-log-larger") {
+            options.max_log_larger = atoi(value);
+        } else if (arg == "--repetitions") {
+            options.repetitions = max(1, atoi(value));
+        } else {
+            return false;
+        }
+    }
+    return options.max_log_smaller < IntersectionCostModel::TABLE_LOG_SIZES
+        && options.max_log_ratio < IntersectionCostModel::TABLE_LOG_SIZES;
+}
+
+int main(int argc, char **argv) {
+    AutotuneOptions options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--out PATH] [--max-log-smaller N] [--max-log-ratio N] "
+                        "[--max-log-larger N] [--repetitions N]\n", argv[0]);
+        return 1;
+    }
+
+    // Коэффициенты формул нужны для клеток вне таблицы и для отсортированных входов.
+    IntersectionCostModel model = IntersectionCostModel::calibrate();
+    mt19937 gen(0);
+
+    for (int log_m = 0; log_m <= options.max_log_smaller; log_m++) {
+        for (int log_ratio = 0; log_ratio <= options.max_log_ratio; log_ratio++) {
+            if (log_m + log_ratio > options.max_log_larger) {
+                break;
+            }
+            size_t m = size_t(1) << log_m;
+            size_t n = m << log_ratio;
+
+            for (int span_cls = 0; span_cls < IntersectionCostModel::TABLE_SPAN_CLASSES; span_cls++) {
+                uint32_t span = span_for_class(span_cls, m);
+                vector<int> smaller = random_values(gen, m, span);
+                IntersectionShape shape = describe_intersection(smaller, smaller);
+                shape.larger_size = n;
+                shape.larger_sorted = false;
+
+                double total[INTERSECTION_STRATEGIES_COUNT] = {};
+                for (double selectivity : SELECTIVITIES) {
+                    vector<int> larger = larger_with_selectivity(gen, smaller, n, span, selectivity);
+                    for (int i = 0; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+                        IntersectionStrategy strategy = (IntersectionStrategy)i;
+                        bool skip = model.cost(strategy, shape) == HUGE_VAL
+                            || (strategy == IntersectionStrategy::by_find && (double)m * n > MAX_FIND_COMPARES);
+                        if (skip) {
+                            total[i] = HUGE_VAL;
+                            continue;
+                        }
+                        total[i] += measure_min_ns([&] {
+                            return count_intersection_with(strategy, shape, smaller, larger);
+                        }, options.repetitions);
+                    }
+                }
+
+                int best = 0;
+                for (int i = 1; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+                    if (total[i] < total[best]) {
+                        best = i;
+                    }
+                }
+                model.set_decision(log_m, log_ratio, span_cls, (IntersectionStrategy)best);
+                fprintf(stderr, "m=2^%d n=2^%d span_class=%d -> %s\n", log_m, log_m + log_ratio, span_cls,
+                        strategy_name((IntersectionStrategy)best));
+            }
+        }
+    }
+
+    if (!model.save(options.out)) {
+        fprintf(stderr, "can't write %s\n", options.out.c_str());
+        return 1;
+    }
+    fprintf(stderr, "profile written to %s\n", options.out.c_str());
+    return 0;
+}
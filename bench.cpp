@@ -0,0 +1,337 @@
+// Бенчмарк всех алгоритмов count_intersection по сетке параметров.
+// Пишет JSON, по одной записи на строку, чтобы результаты разных сборок можно было сравнивать diff'ом.
+//
+// Запуск: ./out/bench [--sizes 10,100,1000,10000] [--ratios 1,10,100] [--hit-rates 0,0.1,0.5,1]
+//                     [--dists uniform,dense,sorted,zipf] [--repetitions 31] [--warm-up 3]
+//                     [--cpu N] [--max-find-compares N] [--perf] [--out bench.json]
+//
+// С --perf дополнительно печатает аппаратные счетчики на элемент (см. perf_counters.hpp).
+
+#include <sched.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "count_intersection.hpp"
+#include "intersection_library.hpp"
+
+struct BenchOptions {
+    vector<size_t> sizes = {10, 100, 1000, 10000};
+    vector<size_t> ratios = {1, 10, 100};
+    vector<double> hit_rates = {0, 0.1, 0.5, 1};
+    vector<string> dists = {"uniform", "dense", "sorted", "zipf"};
+    int repetitions = 31;
+    int warm_up = 3;
+    int cpu = -1;
+    double max_find_compares = 1 << 28;
+    bool perf = false;
+    string out = "out/bench.json";
+};
+
+// Один замер должен длиться хотя бы столько, иначе мешает разрешение таймера.
+const double MIN_SAMPLE_NS = 10000;
+
+// Значения smaller четные, а промахи в larger нечетные, поэтому доля попаданий точная.
+struct BenchInput {
+    vector<int> smaller;
+    vector<int> larger;
+};
+
+BenchInput make_input(mt19937 &gen, const string &dist, size_t m, size_t n, double hit_rate) {
+    // Для dense значения лежат в диапазоне порядка 2m, для остальных - во всем int.
+    int max_half = dist == "dense" ? (int)m : (1 << 30) - 1;
+    uniform_int_distribution<int> uid(dist == "dense" ? 0 : -(1 << 30), max_half);
+
+    BenchInput input;
+    input.smaller.resize(m);
+    for (auto &e : input.smaller) {
+        e = 2 * uid(gen);
+    }
+
+    // Для zipf попадания приходятся в основном на несколько "горячих" элементов smaller.
+    vector<double> zipf_cdf;
+    if (dist == "zipf") {
+        double total = 0;
+        for (size_t rank = 1; rank <= m; rank++) {
+            total += 1.0 / rank;
+            zipf_cdf.push_back(total);
+        }
+        for (auto &p : zipf_cdf) {
+            p /= total;
+        }
+    }
+    uniform_int_distribution<size_t> pick(0, m - 1);
+    uniform_real_distribution<double> unit(0, 1);
+    bernoulli_distribution hit(hit_rate);
+
+    input.larger.resize(n);
+    for (auto &e : input.larger) {
+        if (!hit(gen)) {
+            e = 2 * uid(gen) + 1;
+        } else if (dist == "zipf") {
+            e = input.smaller[lower_bound(begin(zipf_cdf), end(zipf_cdf), unit(gen)) - begin(zipf_cdf)];
+        } else {
+            e = input.smaller[pick(gen)];
+        }
+    }
+
+    if (dist == "sorted") {
+        sort(begin(input.smaller), end(input.smaller));
+        sort(begin(input.larger), end(input.larger));
+    }
+    return input;
+}
+
+struct BenchResult {
+    double median_ns_per_element;
+    double p99_ns_per_element;
+    double elements_per_sec;
+};
+
+template <class Function>
+BenchResult run_bench(Function function, size_t elements, const BenchOptions &options) {
+    for (int r = 0; r < options.warm_up; r++) {
+        measure_min_ns(function, 1);
+    }
+    // Маленькие запросы гоняем пачками, чтобы один замер был не короче MIN_SAMPLE_NS.
+    double single = max(1.0, measure_min_ns(function, 3));
+    int batch = (int)max(1.0, MIN_SAMPLE_NS / single);
+
+    vector<double> samples(options.repetitions);
+    for (auto &sample : samples) {
+        sample = measure_min_ns([&] {
+            int sum = 0;
+            for (int i = 0; i < batch; i++) {
+                sum += function();
+            }
+            return sum;
+        }, 1) / batch / elements;
+    }
+    sort(begin(samples), end(samples));
+
+    BenchResult result;
+    result.median_ns_per_element = samples[samples.size() / 2];
+    result.p99_ns_per_element = samples[min(samples.size() - 1, samples.size() * 99 / 100)];
+    result.elements_per_sec = 1e9 / result.median_ns_per_element;
+    return result;
+}
+
+template <class T, class Parse>
+bool parse_list(const char *value, vector<T> &list, Parse parse) {
+    list.clear();
+    string item;
+    for (const char *p = value; ; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (item.empty()) {
+                return false;
+            }
+            list.push_back(parse(item));
+            item.clear();
+            if (*p == '\0') {
+                break;
+            }
+        } else {
+            item += *p;
+        }
+    }
+    return true;
+}
+
+bool parse_options(int argc, char **argv, BenchOptions &options) {
+    auto to_size = [](const string &s) { return (size_t)atoll(s.c_str()); };
+    auto to_double = [](const string &s) { return atof(s.c_str()); };
+    auto to_string = [](const string &s) { return s; };
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--perf") {
+            options.perf = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return false;
+        }
+        const char *value = argv[++i];
+        bool ok = true;
+        if (arg == "--sizes") {
+            ok = parse_list(value, options.sizes, to_size);
+        } else if (arg == "--ratios") {
+            ok = parse_list(value, options.ratios, to_size);
+        } else if (arg == "--hit-rates") {
+            ok = parse_list(value, options.hit_rates, to_double);
+        } else if (arg == "--dists") {
+            ok = parse_list(value, options.dists, to_string);
+        } else if (arg == "--repetitions") {
+            options.repetitions = max(1, atoi(value));
+        } else if (arg == "--warm-up") {
+            options.warm_up = max(0, atoi(value));
+        } else if (arg == "--cpu") {
+            options.cpu = atoi(value);
+        } else if (arg == "--max-find-compares") {
+            options.max_find_compares = atof(value);
+        } else if (arg == "--out") {
+            options.out = value;
+        } else {
+            return false;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    for (auto &dist : options.dists) {
+        if (dist != "uniform" && dist != "dense" && dist != "sorted" && dist != "zipf") {
+            return false;
+        }
+    }
+    for (auto size : options.sizes) {
+        if (size == 0) {
+            return false;
+        }
+    }
+    for (auto ratio : options.ratios) {
+        if (ratio == 0) {
+            return false;
+        }
+    }
+    // Доля попаданий идет в bernoulli_distribution, вне [0, 1] это UB. Так отсекается и nan.
+    for (auto hit_rate : options.hit_rates) {
+        if (!(hit_rate >= 0 && hit_rate <= 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Счетчики на элемент для одного алгоритма или, если strategy < 0, для всех вместе.
+void print_perf(FILE *out, int strategy) {
+    KernelPerfStats total;
+    for (int i = 0; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+        if (strategy < 0 || strategy == i) {
+            KernelPerfStats stats = kernel_perf_stats((IntersectionStrategy)i);
+            total.calls += stats.calls;
+            total.elements += stats.elements;
+            total.counts += stats.counts;
+        }
+    }
+    bool any_valid = false;
+    for (int e = 0; e < PERF_EVENTS_COUNT; e++) {
+        any_valid |= total.counts.valid[e];
+    }
+    if (total.elements == 0 || !any_valid) {
+        return;
+    }
+
+    printf("%45s", "per element:");
+    fprintf(out, ", \"perf_per_element\": {");
+    bool first = true;
+    for (int e = 0; e < PERF_EVENTS_COUNT; e++) {
+        if (!total.counts.valid[e]) {
+            continue;
+        }
+        double per_element = (double)total.counts.values[e] / total.elements;
+        printf(" %s %.3f", perf_event_name(e), per_element);
+        fprintf(out, "%s\"%s\": %.4f", first ? "" : ", ", perf_event_name(e), per_element);
+        first = false;
+    }
+    if (total.counts.valid[PERF_CYCLES] && total.counts.valid[PERF_INSTRUCTIONS] && total.counts.values[PERF_CYCLES]) {
+        printf(" ipc %.2f", (double)total.counts.values[PERF_INSTRUCTIONS] / total.counts.values[PERF_CYCLES]);
+    }
+    printf("\n");
+    fprintf(out, "}");
+}
+
+bool pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    if (!parse_options(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--sizes LIST] [--ratios LIST] [--hit-rates LIST] "
+                        "[--dists uniform,dense,sorted,zipf] [--repetitions N] [--warm-up N] "
+                        "[--cpu N] [--max-find-compares N] [--perf] [--out PATH]\n", argv[0]);
+        return 1;
+    }
+    if (options.cpu >= 0 && !pin_to_cpu(options.cpu)) {
+        fprintf(stderr, "can't pin to cpu %d\n", options.cpu);
+        return 1;
+    }
+
+    FILE *out = fopen(options.out.c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "can't write %s\n", options.out.c_str());
+        return 1;
+    }
+
+    // Калибровка модели не должна попасть в замеры "auto".
+    intersection_cost_model();
+
+    if (options.perf) {
+        if (!kernel_perf_counters_available()) {
+            fprintf(stderr, "hardware counters are not available, perf values will be missing\n");
+        }
+        set_kernel_perf_counters_enabled(true);
+    }
+    mt19937 gen(0);
+
+    fprintf(out, "[\n");
+    bool first = true;
+    printf("%-8s %8s %10s %5s %-10s %12s %12s %14s\n",
+           "dist", "smaller", "larger", "hits", "strategy", "median ns/el", "p99 ns/el", "elements/sec");
+
+    for (auto &dist : options.dists) {
+        for (auto m : options.sizes) {
+            for (auto ratio : options.ratios) {
+                for (auto hit_rate : options.hit_rates) {
+                    size_t n = m * ratio;
+                    BenchInput input = make_input(gen, dist, m, n, hit_rate);
+                    IntersectionShape shape = vk_db::describe_intersection(input.smaller, input.larger);
+                    const IntersectionCostModel &model = intersection_cost_model();
+
+                    // "auto" - это count_intersection целиком, вместе с выбором алгоритма.
+                    for (int i = -1; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+                        IntersectionStrategy strategy = (IntersectionStrategy)max(i, 0);
+                        const char *name = i < 0 ? "auto" : strategy_name(strategy);
+                        if (i >= 0) {
+                            bool skip = model.cost(strategy, shape) == HUGE_VAL
+                                || (strategy == IntersectionStrategy::by_find && (double)m * n > options.max_find_compares);
+                            if (skip) {
+                                continue;
+                            }
+                        }
+
+                        reset_kernel_perf_stats();
+                        BenchResult result = i < 0
+                            ? run_bench([&] { return vk_db::count_intersection(input.smaller, input.larger); }, m + n, options)
+                            : run_bench([&] {
+                                  return vk_db::count_intersection_with(strategy, shape, input.smaller, input.larger);
+                              }, m + n, options);
+
+                        printf("%-8s %8zu %10zu %5.2f %-10s %12.3f %12.3f %14.4g\n", dist.c_str(), m, n, hit_rate,
+                               name, result.median_ns_per_element, result.p99_ns_per_element, result.elements_per_sec);
+                        fprintf(out, "%s  {\"dist\": \"%s\", \"smaller\": %zu, \"larger\": %zu, \"hit_rate\": %g, "
+                                     "\"strategy\": \"%s\", \"median_ns_per_element\": %.4f, "
+                                     "\"p99_ns_per_element\": %.4f, \"elements_per_sec\": %.6g",
+                                first ? "" : ",\n", dist.c_str(), m, n, hit_rate, name,
+                                result.median_ns_per_element, result.p99_ns_per_element, result.elements_per_sec);
+                        if (options.perf) {
+                            print_perf(out, i < 0 ? -1 : i);
+                        }
+                        fprintf(out, "}");
+                        first = false;
+                    }
+                }
+            }
+        }
+    }
+
+    fprintf(out, "\n]\n");
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+// Сжатые отсортированные списки и пересечение без полной распаковки.
+//
+// Список режется на блоки по COMPRESSED_BLOCK_SIZE значений. Внутри блока хранятся разности
+// соседних значений в формате StreamVByte: сначала управляющие байты (по 2 бита на значение -
+// длина 1..4 байта), затем сами байты разностей. Для каждого блока отдельно хранится
+// skip pointer: первое и последнее значение и смещение блока.
+//
+// Пересечение идет по skip pointer'ам и распаковывает только те блоки, диапазоны которых
+// пересекаются, причем каждый в буфер на 128 значений, который не покидает L1.
+// Распаковка - pshufb на четверку значений и префиксная сумма на SSE2, если процессор
+// умеет SSSE3, иначе обычный цикл.
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VK_DB_COMPRESSED_SSSE3 1
+#endif
+
+#include "count_intersection.hpp"
+
+const size_t COMPRESSED_BLOCK_SIZE = 128;
+
+// Для каждого управляющего байта: длина данных четверки и маска pshufb, раскладывающая
+// байты по 32-битным словам.
+struct StreamVByteTables {
+    uint8_t length[256];
+    uint8_t shuffle[256][16];
+
+    StreamVByteTables() {
+        for (int control = 0; control < 256; control++) {
+            int offset = 0;
+            for (int k = 0; k < 4; k++) {
+                int bytes = ((control >> (2 * k)) & 3) + 1;
+                for (int b = 0; b < 4; b++) {
+                    shuffle[control][4 * k + b] = b < bytes ? offset + b : 0x80;
+                }
+                offset += bytes;
+            }
+            length[control] = offset;
+        }
+    }
+};
+
+inline const StreamVByteTables &stream_vbyte_tables() {
+    static const StreamVByteTables tables;
+    return tables;
+}
+
+// Распаковка count значений, начиная с начала четверки. Значения восстанавливаются
+// от base накопленной суммой разностей. Возвращает указатель на следующий байт данных.
+inline const uint8_t *stream_vbyte_decode_scalar(const uint8_t *control, const uint8_t *data, size_t count,
+                                                 uint32_t base, int *out) {
+    for (size_t k = 0; k < count; k++) {
+        int bytes = ((control[k / 4] >> (2 * (k % 4))) & 3) + 1;
+        uint32_t delta = 0;
+        for (int b = 0; b < bytes; b++) {
+            delta |= (uint32_t)data[b] << (8 * b);
+        }
+        data += bytes;
+        base += delta;
+        out[k] = (int)base;
+    }
+    return data;
+}
+
+#ifdef VK_DB_COMPRESSED_SSSE3
+__attribute__((target("ssse3")))
+inline const uint8_t *stream_vbyte_decode_ssse3(const uint8_t *control, const uint8_t *data, size_t quads,
+                                                uint32_t base, int *out) {
+    const StreamVByteTables &tables = stream_vbyte_tables();
+    __m128i previous = _mm_set1_epi32((int)base);
+    for (size_t q = 0; q < quads; q++) {
+        uint8_t c = control[q];
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        __m128i values = _mm_shuffle_epi8(bytes, _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables.shuffle[c])));
+        // Префиксная сумма четверки за два сдвига.
+        values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+        values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+        values = _mm_add_epi32(values, previous);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4 * q), values);
+        previous = _mm_shuffle_epi32(values, 0xFF);
+        data += tables.length[c];
+    }
+    return data;
+}
+#endif
+
+inline bool stream_vbyte_simd_available() {
+#ifdef VK_DB_COMPRESSED_SSSE3
+    static const bool available = __builtin_cpu_supports("ssse3");
+    return available;
+#else
+    return false;
+#endif
+}
+
+// Отсортированный список различных int в сжатом виде. Неизменяемый.
+class CompressedSortedList {
+public:
+    CompressedSortedList() = default;
+
+    // values должны быть отсортированы по возрастанию.
+    explicit CompressedSortedList(IntArrayView values) : _size(values.size()) {
+        for (size_t first = 0; first < values.size(); first += COMPRESSED_BLOCK_SIZE) {
+            encode_block(values.subview(first, min(COMPRESSED_BLOCK_SIZE, values.size() - first)));
+        }
+        // SIMD-распаковка читает по 16 байт, даже если четверка короче.
+        _bytes.resize(_bytes.size() + 16, 0);
+        _bytes.shrink_to_fit();
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    size_t blocks() const {
+        return _skips.size();
+    }
+
+    // Байт на данные и skip pointer'ы, без учета запаса в конце.
+    size_t compressed_bytes() const {
+        return _bytes.size() - 16 + _skips.size() * sizeof(Skip);
+    }
+
+    size_t block_size(size_t block) const {
+        return min(COMPRESSED_BLOCK_SIZE, _size - block * COMPRESSED_BLOCK_SIZE);
+    }
+
+    int block_first(size_t block) const {
+        return _skips[block].first;
+    }
+
+    int block_last(size_t block) const {
+        return _skips[block].last;
+    }
+
+    // Первый блок, начиная с from, последнее значение которого >= value.
+    // Дальние блоки пропускаются двоичным поиском по skip pointer'ам, ничего не распаковывая.
+    size_t seek_block(int value, size_t from) const {
+        return partition_point(begin(_skips) + from, end(_skips), [&](const Skip &skip) {
+            return skip.last < value;
+        }) - begin(_skips);
+    }
+
+    // Распаковывает блок в out (не меньше COMPRESSED_BLOCK_SIZE элементов), возвращает размер блока.
+    size_t decode_block(size_t block, int *out) const {
+        size_t count = block_size(block);
+        const uint8_t *control = _bytes.data() + _skips[block].offset;
+        const uint8_t *data = control + (count + 3) / 4;
+        size_t done = 0;
+        uint32_t base = (uint32_t)_skips[block].first;
+#ifdef VK_DB_COMPRESSED_SSSE3
+        if (stream_vbyte_simd_available()) {
+            done = count / 4 * 4;
+            data = stream_vbyte_decode_ssse3(control, data, count / 4, base, out);
+            if (done > 0) {
+                base = (uint32_t)out[done - 1];
+            }
+        }
+#endif
+        stream_vbyte_decode_scalar(control + done / 4, data, count - done, base, out + done);
+        return count;
+    }
+
+    size_t decode_block_scalar(size_t block, int *out) const {
+        size_t count = block_size(block);
+        const uint8_t *control = _bytes.data() + _skips[block].offset;
+        stream_vbyte_decode_scalar(control, control + (count + 3) / 4, count, (uint32_t)_skips[block].first, out);
+        return count;
+    }
+
+    vector<int> decode() const {
+        vector<int> values(_skips.size() * COMPRESSED_BLOCK_SIZE);
+        for (size_t block = 0; block < _skips.size(); block++) {
+            decode_block(block, values.data() + block * COMPRESSED_BLOCK_SIZE);
+        }
+        values.resize(_size);
+        return values;
+    }
+
+private:
+    struct Skip {
+        int first;
+        int last;
+        size_t offset; // начало управляющих байтов блока в _bytes
+    };
+
+    vector<Skip> _skips;
+    vector<uint8_t> _bytes;
+    size_t _size = 0;
+
+    void encode_block(IntArrayView values) {
+        Skip skip;
+        skip.first = values[0];
+        skip.last = values[values.size() - 1];
+        skip.offset = _bytes.size();
+        _skips.push_back(skip);
+
+        size_t control = _bytes.size();
+        _bytes.resize(_bytes.size() + (values.size() + 3) / 4, 0);
+        // Разности считаем по модулю 2^32, так что отрицательные значения не мешают.
+        uint32_t previous = (uint32_t)skip.first;
+        for (size_t k = 0; k < values.size(); k++) {
+            uint32_t delta = (uint32_t)values[k] - previous;
+            previous = (uint32_t)values[k];
+            int bytes = delta < (1u << 8) ? 1 : delta < (1u << 16) ? 2 : delta < (1u << 24) ? 3 : 4;
+            _bytes[control + k / 4] |= (bytes - 1) << (2 * (k % 4));
+            for (int b = 0; b < bytes; b++) {
+                _bytes.push_back((uint8_t)(delta >> (8 * b)));
+            }
+        }
+    }
+};
+
+// Пересечение двух сжатых списков. Блоки, диапазоны которых не пересекаются, не распаковываются;
+// если передан decoded_blocks, туда пишется число распакованных блоков.
+inline int count_intersection_compressed(const CompressedSortedList &a, const CompressedSortedList &b,
+                                         size_t *decoded_blocks = nullptr) {
+    int buffer_a[COMPRESSED_BLOCK_SIZE], buffer_b[COMPRESSED_BLOCK_SIZE];
+    size_t decoded_a = a.blocks(), decoded_b = b.blocks(), decoded = 0;
+    size_t size_a = 0, size_b = 0;
+    int ans = 0;
+
+    size_t i = 0, j = 0;
+    while (i < a.blocks() && j < b.blocks()) {
+        if (a.block_last(i) < b.block_first(j)) {
+            i = a.seek_block(b.block_first(j), i);
+            continue;
+        }
+        if (b.block_last(j) < a.block_first(i)) {
+            j = b.seek_block(a.block_first(i), j);
+            continue;
+        }
+        if (decoded_a != i) {
+            size_a = a.decode_block(i, buffer_a);
+            decoded_a = i;
+            ++decoded;
+        }
+        if (decoded_b != j) {
+            size_b = b.decode_block(j, buffer_b);
+            decoded_b = j;
+            ++decoded;
+        }
+        ans += count_intersection_by_merge(IntArrayView(buffer_a, size_a), IntArrayView(buffer_b, size_b));
+
+        int last_a = a.block_last(i), last_b = b.block_last(j);
+        i += last_a <= last_b;
+        j += last_b <= last_a;
+    }
+
+    if (decoded_blocks) {
+        *decoded_blocks = decoded;
+    }
+    return ans;
+}
+
+// Пересечение обычного массива со сжатым списком: для каждого значения smaller (по возрастанию)
+// находим блок по skip pointer'ам и ищем значение в распакованном блоке.
+// Выгодно, когда smaller намного меньше larger: большинство блоков larger не распаковывается.
+inline int count_intersection_compressed(IntArrayView smaller, const CompressedSortedList &larger,
+                                         size_t *decoded_blocks = nullptr) {
+    vector<int> sorted_cp;
+    if (!smaller.known_sorted() && !is_sorted(begin(smaller), end(smaller))) {
+        sorted_cp.assign(begin(smaller), end(smaller));
+        sort(begin(sorted_cp), end(sorted_cp));
+        smaller = sorted_cp;
+    }
+
+    int buffer[COMPRESSED_BLOCK_SIZE];
+    size_t decoded = larger.blocks(), block = 0, block_size = 0, position = 0, decoded_count = 0;
+    int ans = 0;
+
+    for (auto e : smaller) {
+        block = larger.seek_block(e, block);
+        if (block == larger.blocks()) {
+            break;
+        }
+        if (e < larger.block_first(block)) {
+            continue;
+        }
+        if (decoded != block) {
+            block_size = larger.decode_block(block, buffer);
+            decoded = block;
+            position = 0;
+            ++decoded_count;
+        }
+        position = lower_bound(buffer + position, buffer + block_size, e) - buffer;
+        ans += position < block_size && buffer[position] == e;
+    }
+
+    if (decoded_blocks) {
+        *decoded_blocks = decoded_count;
+    }
+    return ans;
+}
@@ -0,0 +1,92 @@
+// Утилита командной строки: размер пересечения двух множеств из файлов.
+//
+// Запуск: ./out/count_intersection [--strategy by_find|by_hash|by_sort|by_merge|by_bitmap|by_eytzinger] A B
+//
+// Файл - либо бинарный (int_set_file.hpp, открывается через mmap без разбора), либо текст
+// с числами через пробелы или переводы строк. Печатает размер пересечения, выбранный алгоритм
+// и время каждого этапа.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "count_intersection.hpp"
+#include "intersection_library.hpp"
+#include "int_set_file.hpp"
+
+double elapsed_ms(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    vector<string> paths;
+    bool forced = false;
+    IntersectionStrategy strategy = IntersectionStrategy::by_hash;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--strategy" && i + 1 < argc) {
+            if (!strategy_from_name(argv[++i], strategy)) {
+                fprintf(stderr, "unknown strategy %s\n", argv[i]);
+                return 1;
+            }
+            forced = true;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        fprintf(stderr, "usage: %s [--strategy by_find|by_hash|by_sort|by_merge|by_bitmap|by_eytzinger] A B\n", argv[0]);
+        return 1;
+    }
+
+    LoadedIntSet sets[2];
+    double load_ms[2];
+    for (int i = 0; i < 2; i++) {
+        auto start = chrono::steady_clock::now();
+        string error;
+        if (!load_int_set(paths[i], sets[i], &error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        load_ms[i] = elapsed_ms(start);
+    }
+
+    // Модель калибруется при первом обращении, это не должно попасть во время выбора.
+    auto start = chrono::steady_clock::now();
+    intersection_cost_model();
+    double model_ms = elapsed_ms(start);
+
+    IntArrayView smaller = sets[0].view, larger = sets[1].view;
+    if (smaller.size() > larger.size()) {
+        swap(smaller, larger);
+    }
+    int count = 0;
+    double describe_ms = 0, intersect_ms = 0;
+    if (!smaller.empty()) {
+        start = chrono::steady_clock::now();
+        IntersectionShape shape = vk_db::describe_intersection(smaller, larger);
+        if (!forced) {
+            strategy = intersection_cost_model().choose(shape);
+        } else if (intersection_cost_model().cost(strategy, shape) == HUGE_VAL) {
+            fprintf(stderr, "strategy %s can't be used for these inputs\n", strategy_name(strategy));
+            return 1;
+        }
+        describe_ms = elapsed_ms(start);
+
+        start = chrono::steady_clock::now();
+        count = vk_db::count_intersection_with(strategy, shape, smaller, larger);
+        intersect_ms = elapsed_ms(start);
+    }
+
+    printf("%d\n", count);
+    fprintf(stderr, "strategy   %s%s\n", strategy_name(strategy), forced ? " (forced)" : "");
+    for (int i = 0; i < 2; i++) {
+        fprintf(stderr, "load       %9.3f ms  %s: %zu values, %s\n", load_ms[i], paths[i].c_str(),
+                sets[i].view.size(), sets[i].binary ? "binary" : "text");
+    }
+    fprintf(stderr, "model      %9.3f ms\n", model_ms);
+    fprintf(stderr, "describe   %9.3f ms\n", describe_ms);
+    fprintf(stderr, "intersect  %9.3f ms\n", intersect_ms);
+    return 0;
+}
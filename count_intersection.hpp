@@ -0,0 +1,1298 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VK_DB_HASH_AVX2 1
+#endif
+
+#include "perf_counters.hpp"
+#include "scratch_arena.hpp"
+#include "telemetry.hpp"
+
+using namespace std;
+
+inline int floor_log2(size_t x) {
+    int log = 0;
+    while (x >>= 1) {
+        ++log;
+    }
+    return log;
+}
+
+// Массив int без владения памятью: vector<int>, кусок другого массива, файл в mmap и т.п.
+// Все алгоритмы принимают его, поэтому работают с любыми такими данными без копирования.
+class IntArrayView {
+public:
+    IntArrayView() = default;
+    IntArrayView(const int *data, size_t size, bool known_sorted = false)
+        : _data(data), _size(size), _known_sorted(known_sorted) {}
+    IntArrayView(const vector<int> &values) : _data(values.data()), _size(values.size()) {}
+
+    const int *data() const {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    bool empty() const {
+        return _size == 0;
+    }
+
+    const int *begin() const {
+        return _data;
+    }
+
+    const int *end() const {
+        return _data + _size;
+    }
+
+    int operator[](size_t i) const {
+        return _data[i];
+    }
+
+    // Известно ли заранее, что массив отсортирован. false значит "неизвестно".
+    bool known_sorted() const {
+        return _known_sorted;
+    }
+
+    IntArrayView subview(size_t offset, size_t count) const {
+        return IntArrayView(_data + offset, count, _known_sorted);
+    }
+
+private:
+    const int *_data = nullptr;
+    size_t _size = 0;
+    bool _known_sorted = false;
+};
+
+// Статистика заполнения FastIntHashSet. Расстояние пробы - сколько слотов после
+// "домашнего" home_slot(x, capacity) пришлось пройти: 0 - нашли сразу.
+struct FastIntHashSetStats {
+    double load_factor = 0;
+    double average_hit_probe = 0;  // по всем элементам таблицы
+    size_t max_hit_probe = 0;
+    double average_miss_probe = 0; // для отсутствующего ключа, по всем возможным домашним слотам
+    size_t max_miss_probe = 0;
+    size_t clusters = 0;           // непрерывные куски занятых слотов
+    // cluster_histogram[k] - число кластеров длины от 2^k до 2^(k+1) - 1
+    vector<size_t> cluster_histogram;
+};
+
+// Слоты пробируются по индексу int, поэтому таблица не может быть больше.
+const size_t MAX_HASH_SET_CAPACITY = INT_MAX;
+
+// Стандартные хеш-таблици std::unordered_set и std::unordered_map работают с
+// невероятно большой константой, поэтому пишем свою с открытой адресацией и
+// минимальным необходимым функционалом.
+//
+// Слот занят, только если его метка равна текущему поколению _epoch, поэтому clear()
+// просто увеличивает поколение. Раз в 255 очисток метки переполняются и их приходится
+// обнулить по-настоящему, но только в той части памяти, куда писали с прошлого обнуления.
+class FastIntHashSet {
+public:
+    FastIntHashSet(int capacity) : _own_array(capacity), _own_status(status_bytes(capacity), 0) {
+        _array = _own_array.data();
+        _status = _own_status.data();
+        _capacity = _reserved = _dirty = capacity;
+    }
+
+    // Таблица в памяти арены: живет, пока жив текущий ScratchArena::Scope.
+    // Емкость больше MAX_HASH_SET_CAPACITY - ошибка вызывающего, как слишком большой vector.
+    FastIntHashSet(size_t capacity, ScratchArena &arena) {
+        if (capacity > MAX_HASH_SET_CAPACITY) {
+            throw length_error("FastIntHashSet capacity exceeds MAX_HASH_SET_CAPACITY");
+        }
+        _array = arena.allocate_array<int>(capacity);
+        _status = arena.allocate_array<uint8_t>(status_bytes(capacity));
+        _capacity = _reserved = _dirty = capacity;
+        memset(_status, 0, capacity);
+    }
+
+    // Таблица поверх чужой памяти, например снимка из файла (hash_set_snapshot.hpp).
+    // Слот i занят, если status[i] == epoch. Память должна жить дольше таблицы.
+    FastIntHashSet(int *array, uint8_t *status, size_t capacity, size_t size, uint8_t epoch)
+        : _array(array), _status(status), _capacity(capacity), _reserved(capacity), _dirty(capacity),
+          _size(size), _epoch(epoch) {}
+
+    // Копия указывала бы на чужую память.
+    FastIntHashSet(const FastIntHashSet &) = delete;
+    FastIntHashSet &operator=(const FastIntHashSet &) = delete;
+    FastIntHashSet(FastIntHashSet &&) = default;
+
+    void add(int element) {
+        size_t i = get_index(element);
+        if (_status[i] != _epoch) {
+            _array[i] = element;
+            _status[i] = _epoch;
+            ++_size;
+        }
+    }
+
+    bool contains(int element) const {
+        return _status[get_index(element)] == _epoch;
+    }
+
+    // Сколько элементов probe есть в таблице. Если процессор умеет AVX2, то хеши
+    // и домашние слоты считаются сразу для 8 элементов, слоты и метки собираются
+    // gather'ом, а скалярно допроверяются только те, чей домашний слот занят другим ключом.
+    int count_contained(IntArrayView probe) const {
+#ifdef VK_DB_HASH_AVX2
+        if (hash_probe_avx2_available() && _capacity > 0 && _capacity <= INT32_MAX) {
+            return count_contained_avx2(probe);
+        }
+#endif
+        int ans = 0;
+        for (auto e : probe) {
+            ans += contains(e);
+        }
+        return ans;
+    }
+
+    // Удаляет все элементы за O(1) (амортизированно).
+    void clear() {
+        _size = 0;
+        _dirty = max(_dirty, _capacity);
+        if (++_epoch == 0) {
+            memset(_status, 0, _dirty);
+            _dirty = 0;
+            _epoch = 1;
+        }
+    }
+
+    // Очищает таблицу и меняет емкость. Если емкость не больше уже выделенной памяти,
+    // то это тот же clear(), иначе выделяется своя память.
+    void reset(size_t capacity) {
+        if (capacity > _reserved) {
+            _own_array = vector<int>(capacity);
+            _own_status = vector<uint8_t>(status_bytes(capacity), 0);
+            _array = _own_array.data();
+            _status = _own_status.data();
+            _capacity = _reserved = _dirty = capacity;
+            _size = 0;
+            _epoch = 1;
+            return;
+        }
+        clear();
+        _capacity = capacity;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    // Сырые слоты и метки, нужны для снимков.
+    const int *slots() const {
+        return _array;
+    }
+
+    const uint8_t *tags() const {
+        return _status;
+    }
+
+    uint8_t epoch() const {
+        return _epoch;
+    }
+
+    // Считается за O(capacity), для диагностики, а не для горячего пути.
+    FastIntHashSetStats stats() const {
+        FastIntHashSetStats result;
+        size_t n = _capacity;
+        if (n == 0) {
+            return result;
+        }
+        result.load_factor = (double)_size / n;
+
+        size_t hit_total = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (_status[i] == _epoch) {
+                size_t home = home_slot(_array[i], n);
+                size_t probe = (i + n - home) % n;
+                hit_total += probe;
+                result.max_hit_probe = max(result.max_hit_probe, probe);
+            }
+        }
+        if (_size) {
+            result.average_hit_probe = (double)hit_total / _size;
+        }
+
+        // Таблица заполнена целиком, промах никогда не закончится.
+        size_t empty = 0;
+        while (empty < n && _status[empty] == _epoch) {
+            ++empty;
+        }
+        if (empty == n) {
+            result.average_miss_probe = result.max_miss_probe = n;
+            result.clusters = 1;
+            result.cluster_histogram.assign(floor_log2(n) + 1, 0);
+            result.cluster_histogram.back() = 1;
+            return result;
+        }
+
+        // Идем по кругу от пустого слота. Промах с домашним слотом внутри кластера длины L
+        // на позиции j проходит L - j слотов, на пустом слоте - 0.
+        size_t miss_total = 0;
+        size_t run = 0;
+        for (size_t k = 1; k <= n; k++) {
+            size_t i = (empty + k) % n;
+            if (_status[i] == _epoch) {
+                ++run;
+                continue;
+            }
+            if (run) {
+                miss_total += run * (run + 1) / 2;
+                result.max_miss_probe = max(result.max_miss_probe, run);
+                ++result.clusters;
+                size_t bucket = floor_log2(run);
+                if (result.cluster_histogram.size() <= bucket) {
+                    result.cluster_histogram.resize(bucket + 1);
+                }
+                ++result.cluster_histogram[bucket];
+                run = 0;
+            }
+        }
+        result.average_miss_probe = (double)miss_total / n;
+        return result;
+    }
+
+    // Взял отсюда https://gist.github.com/badboy/6267743
+    static uint32_t good_hash(uint32_t a) {
+       a = (a+0x7ed55d16) + (a<<12);
+       a = (a^0xc761c23c) ^ (a>>19);
+       a = (a+0x165667b1) + (a<<5);
+       a = (a+0xd3a2646c) ^ (a<<9);
+       a = (a+0xfd7046c5) + (a<<3);
+       a = (a^0xb55a4f09) ^ (a>>16);
+       return a;
+    }
+
+    // Домашний слот: старшие биты произведения good_hash(x) * capacity. Это то же
+    // равномерное отображение в [0, capacity), что и остаток, но без деления,
+    // и считается в векторных регистрах.
+    static size_t home_slot(int element, size_t capacity) {
+        return ((uint64_t)good_hash(element) * capacity) >> 32;
+    }
+
+private:
+    int *_array;
+    uint8_t *_status; // метки поколений, байт работает быстрее чем vector<bool>
+    size_t _capacity;
+    size_t _reserved; // сколько слотов выделено, capacity() может быть меньше после reset()
+    size_t _dirty;    // в слотах [0, _dirty) могут быть ненулевые метки
+    size_t _size = 0;
+    uint8_t _epoch = 1;
+    // Своя память, если таблица создана не в арене.
+    vector<int> _own_array;
+    vector<uint8_t> _own_status;
+
+    size_t get_index(int element) const {
+        return probe_from(home_slot(element, _capacity), element);
+    }
+
+    // Линейное пробирование, начиная со слота i.
+    size_t probe_from(int i, int element) const {
+        while (_status[i] == _epoch && _array[i] != element) {
+            if (++i == (int)_capacity) {
+                i = 0;
+            }
+        }
+        return i;
+    }
+
+    // Меток выделяем с запасом до кратного 4, чтобы gather мог читать их выровненными
+    // 4-байтными словами. В снимке (hash_set_snapshot.hpp) метки идут последними в файле,
+    // и такое слово не выходит за последнюю страницу отображения.
+    static size_t status_bytes(size_t capacity) {
+        return (capacity + 3) & ~(size_t)3;
+    }
+
+#ifdef VK_DB_HASH_AVX2
+    static bool hash_probe_avx2_available() {
+        static const bool available = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        return available;
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i good_hash_avx2(__m256i a) {
+        a = _mm256_add_epi32(_mm256_add_epi32(a, _mm256_set1_epi32(0x7ed55d16)), _mm256_slli_epi32(a, 12));
+        a = _mm256_xor_si256(_mm256_xor_si256(a, _mm256_set1_epi32(0xc761c23c)), _mm256_srli_epi32(a, 19));
+        a = _mm256_add_epi32(_mm256_add_epi32(a, _mm256_set1_epi32(0x165667b1)), _mm256_slli_epi32(a, 5));
+        a = _mm256_xor_si256(_mm256_add_epi32(a, _mm256_set1_epi32(0xd3a2646c)), _mm256_slli_epi32(a, 9));
+        a = _mm256_add_epi32(_mm256_add_epi32(a, _mm256_set1_epi32(0xfd7046c5)), _mm256_slli_epi32(a, 3));
+        a = _mm256_xor_si256(_mm256_xor_si256(a, _mm256_set1_epi32(0xb55a4f09)), _mm256_srli_epi32(a, 16));
+        return a;
+    }
+
+    // home_slot для 8 элементов: старшие половины 64-битных произведений, четные и нечетные отдельно.
+    __attribute__((target("avx2")))
+    static __m256i home_slot_avx2(__m256i elements, __m256i capacity) {
+        __m256i h = good_hash_avx2(elements);
+        __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(h, capacity), 32);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(h, 32), capacity);
+        return _mm256_blend_epi32(even, odd, 0xAA);
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    int count_contained_avx2(IntArrayView probe) const {
+        const __m256i capacity = _mm256_set1_epi32((int)_capacity);
+        const __m256i epoch = _mm256_set1_epi32(_epoch);
+        const __m256i three = _mm256_set1_epi32(3);
+        const __m256i low_byte = _mm256_set1_epi32(0xFF);
+        int ans = 0;
+        size_t i = 0;
+        for (; i + 8 <= probe.size(); i += 8) {
+            __m256i elements = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(probe.data() + i));
+            __m256i home = home_slot_avx2(elements, capacity);
+            __m256i slots = _mm256_i32gather_epi32(_array, home, 4);
+            // Метка - байт: читаем выровненное слово с ней и сдвигаем ее в младший байт.
+            __m256i tag_words = _mm256_i32gather_epi32(reinterpret_cast<const int *>(_status),
+                                                       _mm256_andnot_si256(three, home), 1);
+            __m256i tags = _mm256_and_si256(
+                _mm256_srlv_epi32(tag_words, _mm256_slli_epi32(_mm256_and_si256(home, three), 3)), low_byte);
+            __m256i occupied = _mm256_cmpeq_epi32(tags, epoch);
+            __m256i equal = _mm256_cmpeq_epi32(slots, elements);
+            ans += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(occupied, equal))));
+            // Домашний слот занят другим ключом: дальше пробируем как обычно.
+            int collided = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(equal, occupied)));
+            if (collided) {
+                alignas(32) int homes[8];
+                _mm256_store_si256(reinterpret_cast<__m256i *>(homes), home);
+                for (; collided; collided &= collided - 1) {
+                    int lane = __builtin_ctz(collided);
+                    int next = homes[lane] + 1 == (int)_capacity ? 0 : homes[lane] + 1;
+                    ans += _status[probe_from(next, probe[i + lane])] == _epoch;
+                }
+            }
+        }
+        for (; i < probe.size(); i++) {
+            ans += contains(probe[i]);
+        }
+        return ans;
+    }
+#endif
+};
+
+// Таблица потока для идущих подряд запросов: reset() стоит O(1) и не выделяет память,
+// если емкость не больше, чем у прошлых запросов.
+inline FastIntHashSet &thread_hash_set(size_t capacity) {
+    static thread_local FastIntHashSet hash_set(0);
+    hash_set.reset(capacity);
+    return hash_set;
+}
+
+// Таблицы больше этого не держим в потоке навсегда, а строим в арене.
+const size_t MAX_THREAD_HASH_SET_CAPACITY = 1 << 22;
+
+// Вызывает function(FastIntHashSet &) с пустой таблицей емкости capacity.
+// Считаем что capacity <= MAX_HASH_SET_CAPACITY.
+template <class Function>
+auto with_empty_hash_set(size_t capacity, Function function) {
+    if (capacity <= MAX_THREAD_HASH_SET_CAPACITY) {
+        return function(thread_hash_set(capacity));
+    }
+    ScratchArena::Scope scope(thread_scratch_arena());
+    FastIntHashSet hash_set(capacity, scope.arena());
+    return function(hash_set);
+}
+
+// Решение с хеш-таблицей. Считаем что 0 < smaller.size() <= larger.size().
+inline int count_intersection_by_hash(IntArrayView smaller, IntArrayView larger) {
+    return with_empty_hash_set(2 * smaller.size(), [&](FastIntHashSet &hash_set) {
+        for (auto e : smaller) {
+            hash_set.add(e);
+        }
+        return hash_set.count_contained(larger);
+    });
+}
+
+// Простое решение. Считаем что 0 < smaller.size() <= larger.size().
+inline int count_intersection_by_find(IntArrayView smaller, IntArrayView larger) {
+    int ans = 0;
+
+    // Вложенность именно такая, так как маленький массив кэшируется процессором
+    for (auto e : larger) {
+        ans += (find(begin(smaller), end(smaller), e) != end(smaller));
+    }
+
+    return ans;
+}
+
+// by_find для маленького smaller, когда его размер N известен при компиляции: smaller целиком
+// лежит в регистрах, а внутренний цикл полностью разворачивается.
+// Хвост до N заполняется копиями smaller[0], а попадания складываются через "или",
+// поэтому копии не засчитываются дважды. Считаем что 0 < smaller.size() <= N.
+//
+// До 16 ключей компилятор сам векторизует такой цикл по элементам larger.
+template <size_t N>
+int count_intersection_by_find_fixed(IntArrayView smaller, IntArrayView larger) {
+    int keys[N];
+    for (size_t k = 0; k < N; k++) {
+        keys[k] = smaller[k < smaller.size() ? k : 0];
+    }
+
+    int ans = 0;
+    for (auto e : larger) {
+        int hit = 0;
+        for (size_t k = 0; k < N; k++) {
+            hit |= keys[k] == e;
+        }
+        ans += hit;
+    }
+    return ans;
+}
+
+// Для 32 и 64 ключей он уже сдается, поэтому сравниваем по четыре ключа векторами GCC:
+// сравнение дает -1 в совпавших позициях.
+typedef int IntVector4 __attribute__((vector_size(16)));
+
+template <size_t N>
+int count_intersection_by_find_fixed_vector(IntArrayView smaller, IntArrayView larger) {
+    IntVector4 keys[N / 4];
+    for (size_t k = 0; k < N; k++) {
+        keys[k / 4][k % 4] = smaller[k < smaller.size() ? k : 0];
+    }
+
+    int ans = 0;
+    for (auto e : larger) {
+        IntVector4 value = {e, e, e, e};
+        IntVector4 hit = keys[0] == value;
+        for (size_t k = 1; k < N / 4; k++) {
+            hit |= keys[k] == value;
+        }
+        ans -= hit[0] | hit[1] | hit[2] | hit[3];
+    }
+    return ans;
+}
+
+const size_t MAX_FIXED_FIND_SIZE = 64;
+
+// Размер, до которого дополняется smaller в count_intersection_by_find_small.
+inline size_t fixed_find_size(size_t smaller_size) {
+    return smaller_size <= 8 ? 8 : smaller_size <= 16 ? 16 : smaller_size <= 32 ? 32 : 64;
+}
+
+// Выбирает ядро по размеру через таблицу переходов. Считаем что 0 < smaller.size() <= MAX_FIXED_FIND_SIZE.
+inline int count_intersection_by_find_small(IntArrayView smaller, IntArrayView larger) {
+    typedef int (*Kernel)(IntArrayView, IntArrayView);
+    static const Kernel kernels[MAX_FIXED_FIND_SIZE / 8] = {
+        count_intersection_by_find_fixed<8>, count_intersection_by_find_fixed<16>,
+        count_intersection_by_find_fixed_vector<32>, count_intersection_by_find_fixed_vector<32>,
+        count_intersection_by_find_fixed_vector<64>, count_intersection_by_find_fixed_vector<64>,
+        count_intersection_by_find_fixed_vector<64>, count_intersection_by_find_fixed_vector<64>,
+    };
+    return kernels[(smaller.size() - 1) / 8](smaller, larger);
+}
+
+// Решение сортировкой маленького массива и бинпоиском. Считаем что 0 < smaller.size() <= larger.size().
+inline int count_intersection_by_binary_search(IntArrayView sorted_smaller, IntArrayView larger) {
+    int ans = 0;
+
+    for (auto e : larger) {
+        ans += binary_search(begin(sorted_smaller), end(sorted_smaller), e);
+    }
+
+    return ans;
+}
+
+inline int count_intersection_by_sort(IntArrayView smaller, IntArrayView larger) {
+    vector<int> smaller_cp(begin(smaller), end(smaller));
+    sort(begin(smaller_cp), end(smaller_cp));
+
+    return count_intersection_by_binary_search(smaller_cp, larger);
+}
+
+// Слияние двух отсортированных массивов за O(n + m).
+inline int count_intersection_by_merge(IntArrayView sorted_smaller, IntArrayView sorted_larger) {
+    int ans = 0;
+
+    size_t i = 0;
+    for (auto e : sorted_larger) {
+        while (i < sorted_smaller.size() && sorted_smaller[i] < e) {
+            ++i;
+        }
+        if (i == sorted_smaller.size()) {
+            break;
+        }
+        ans += (sorted_smaller[i] == e);
+    }
+
+    return ans;
+}
+
+// Битовая маска по диапазону значений [min(smaller), max(smaller)].
+// Выгодно, когда значения smaller лежат плотно.
+inline int count_intersection_by_bitmap(IntArrayView smaller, IntArrayView larger) {
+    int ans = 0;
+
+    auto min_max = minmax_element(begin(smaller), end(smaller));
+    // Считаем в uint32_t, чтобы разность не переполнялась.
+    uint32_t low = *min_max.first;
+    uint32_t span = (uint32_t)*min_max.second - low;
+
+    size_t words = span / 64 + 1;
+    ScratchArena::Scope scope(thread_scratch_arena());
+    uint64_t *bits = scope.arena().allocate_array<uint64_t>(words);
+    memset(bits, 0, words * sizeof(uint64_t));
+    for (auto e : smaller) {
+        uint32_t offset = (uint32_t)e - low;
+        bits[offset >> 6] |= uint64_t(1) << (offset & 63);
+    }
+
+    for (auto e : larger) {
+        uint32_t offset = (uint32_t)e - low;
+        ans += (offset <= span) && ((bits[offset >> 6] >> (offset & 63)) & 1);
+    }
+
+    return ans;
+}
+
+// Раскладка Эйтцингера: отсортированный smaller в порядке обхода дерева поиска в ширину,
+// корень в tree[1], дети вершины k - в 2k и 2k + 1. Первые уровни всех поисков лежат рядом
+// и живут в кэше, а спуск без ветвлений можно подгружать на несколько уровней вперед.
+inline void eytzinger_fill(const int *sorted, int *tree, size_t size, size_t &next, size_t k) {
+    if (k <= size) {
+        eytzinger_fill(sorted, tree, size, next, 2 * k);
+        tree[k] = sorted[next++];
+        eytzinger_fill(sorted, tree, size, next, 2 * k + 1);
+    }
+}
+
+// Есть ли value в дереве из size элементов (tree[1..size]).
+inline bool eytzinger_contains(const int *tree, size_t size, int value) {
+    size_t k = 1;
+    while (k <= size) {
+        // 16 int - одна кэш-линия с потомками вершины k на 4 уровня ниже.
+        __builtin_prefetch(tree + 16 * k);
+        k = 2 * k + (tree[k] < value);
+    }
+    // Последний поворот направо, после которого шли только налево, указывает на lower_bound.
+    k >>= __builtin_ffsll(~k);
+    return k != 0 && tree[k] == value;
+}
+
+// До такого размера дерево вместе с потоком larger живет в L1, дальше каждый уровень
+// стоит примерно вдвое дороже (см. eytzinger_cold_step в модели).
+const size_t EYTZINGER_CACHED_SIZE = 1 << 13;
+
+// Бинпоиск по smaller в раскладке Эйтцингера. Если smaller не помечен как отсортированный,
+// то сначала сортируется копия. Считаем что 0 < smaller.size() <= larger.size().
+inline int count_intersection_by_eytzinger(IntArrayView smaller, IntArrayView larger) {
+    ScratchArena::Scope scope(thread_scratch_arena());
+    const int *sorted = smaller.data();
+    if (!smaller.known_sorted()) {
+        int *sorted_cp = scope.arena().allocate_array<int>(smaller.size());
+        copy(begin(smaller), end(smaller), sorted_cp);
+        sort(sorted_cp, sorted_cp + smaller.size());
+        sorted = sorted_cp;
+    }
+    // Арена выравнивает по кэш-линии, так что tree[16k..16k+15] всегда одна линия.
+    int *tree = scope.arena().allocate_array<int>(smaller.size() + 1);
+    size_t next = 0;
+    eytzinger_fill(sorted, tree, smaller.size(), next, 1);
+
+    int ans = 0;
+    for (auto e : larger) {
+        ans += eytzinger_contains(tree, smaller.size(), e);
+    }
+    return ans;
+}
+
+// Выбор алгоритма.
+// Раньше выбирали по одной константе min(m, n) < 110, подобранной на одном ноутбуке.
+// Теперь оцениваем время каждого алгоритма по модели стоимости, коэффициенты которой
+// либо замеряются при первом вызове, либо читаются из сохраненного профиля.
+
+enum class IntersectionStrategy {
+    by_find,
+    by_hash,
+    by_sort,   // бинпоиск по smaller, если smaller не отсортирован, то сначала сортируем копию
+    by_merge,  // слияние, требует отсортированный larger
+    by_bitmap, // битовая маска по диапазону значений smaller
+    by_eytzinger, // бинпоиск без ветвлений по smaller в раскладке Эйтцингера
+};
+
+const int INTERSECTION_STRATEGIES_COUNT = 6;
+
+inline const char *strategy_name(IntersectionStrategy strategy) {
+    switch (strategy) {
+        case IntersectionStrategy::by_find: return "by_find";
+        case IntersectionStrategy::by_hash: return "by_hash";
+        case IntersectionStrategy::by_sort: return "by_sort";
+        case IntersectionStrategy::by_merge: return "by_merge";
+        case IntersectionStrategy::by_bitmap: return "by_bitmap";
+        case IntersectionStrategy::by_eytzinger: return "by_eytzinger";
+    }
+    return "unknown";
+}
+
+inline bool strategy_from_name(const string &name, IntersectionStrategy &strategy) {
+    for (int i = 0; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+        if (name == strategy_name((IntersectionStrategy)i)) {
+            strategy = (IntersectionStrategy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Все, что модель знает о входе. Считается за один проход по smaller, по larger
+// только проверка на отсортированность, которая на случайных данных заканчивается сразу.
+struct IntersectionShape {
+    size_t smaller_size = 0;
+    size_t larger_size = 0;
+    bool smaller_sorted = false;
+    bool larger_sorted = false;
+    uint32_t smaller_span = 0; // max(smaller) - min(smaller)
+};
+
+inline IntersectionShape describe_intersection(IntArrayView smaller, IntArrayView larger) {
+    IntersectionShape shape;
+    shape.smaller_size = smaller.size();
+    shape.larger_size = larger.size();
+
+    // Если про отсортированность известно заранее (например, из заголовка файла), проходы не нужны.
+    if (smaller.known_sorted()) {
+        shape.smaller_sorted = true;
+        shape.smaller_span = (uint32_t)smaller[smaller.size() - 1] - (uint32_t)smaller[0];
+    } else {
+        int low = smaller[0];
+        int high = smaller[0];
+        bool sorted = true;
+        for (size_t i = 1; i < smaller.size(); i++) {
+            low = min(low, smaller[i]);
+            high = max(high, smaller[i]);
+            sorted &= (smaller[i - 1] <= smaller[i]);
+        }
+        shape.smaller_sorted = sorted;
+        shape.smaller_span = (uint32_t)high - (uint32_t)low;
+    }
+    shape.larger_sorted = larger.known_sorted() || is_sorted(begin(larger), end(larger));
+
+    return shape;
+}
+
+// Время в наносекундах на единицу работы каждого алгоритма.
+// Значения по умолчанию - калибровка на машине разработки. hash_probe считан уже
+// с векторной count_contained: поиск подешевел примерно вдвое, и граница между by_find
+// и by_hash на обычном find сдвинулась со 110 к 60.
+struct IntersectionCostModel {
+    double find_compare = 0.25;  // одно сравнение в by_find
+    double fixed_find_compare = 0.05; // одно сравнение в by_find для smaller не больше MAX_FIXED_FIND_SIZE
+    double hash_build = 2.0;     // вставка одного элемента в FastIntHashSet
+    double hash_probe = 15.0;    // один поиск в FastIntHashSet
+    double sort_element = 6.0;   // сортировка, на элемент и уровень log2
+    double search_step = 8.5;    // бинпоиск, на элемент и уровень log2
+    double merge_step = 3.0;     // слияние, на элемент обоих массивов
+    double bitmap_word = 0.4;    // обнуление одного слова маски
+    double bitmap_build = 3.0;   // установка одного бита
+    double bitmap_probe = 1.4;   // проверка одного бита
+    double eytzinger_step = 1.4; // поиск в раскладке Эйтцингера, на элемент и уровень log2
+    double eytzinger_cold_step = 2.8; // то же, когда дерево не помещается в L1
+
+    // Маска больше этого размера не строится, даже если модель считает ее выгодной.
+    static const uint32_t MAX_BITMAP_SPAN = 1u << 28;
+
+    // Таблица решений, которую пишет autotune: клетка (log2 m, log2 (n / m), класс диапазона)
+    // хранит замеренный лучший алгоритм и важнее формул. autotune перебирает только
+    // неотсортированные входы, поэтому для отсортированного larger таблица не используется.
+    static const int TABLE_LOG_SIZES = 32;
+    static const int TABLE_SPAN_CLASSES = 3;
+    vector<signed char> decisions; // пустая, если таблицы нет, -1 - клетка не замерена
+
+    // 0 - диапазон не больше 4m, 1 - не больше 64m, 2 - разреженные значения.
+    static int span_class(size_t smaller_size, uint32_t span) {
+        if (span <= 4 * (uint64_t)smaller_size) {
+            return 0;
+        }
+        if (span <= 64 * (uint64_t)smaller_size) {
+            return 1;
+        }
+        return 2;
+    }
+
+    void set_decision(int log_m, int log_ratio, int span_cls, IntersectionStrategy strategy) {
+        if (decisions.empty()) {
+            decisions.assign(TABLE_LOG_SIZES * TABLE_LOG_SIZES * TABLE_SPAN_CLASSES, -1);
+        }
+        decisions[table_index(log_m, log_ratio, span_cls)] = (signed char)strategy;
+    }
+
+    bool lookup(const IntersectionShape &shape, IntersectionStrategy &strategy) const {
+        if (decisions.empty() || shape.larger_sorted) {
+            return false;
+        }
+        int log_m = min(floor_log2(shape.smaller_size), TABLE_LOG_SIZES - 1);
+        int log_ratio = min(floor_log2(shape.larger_size / shape.smaller_size), TABLE_LOG_SIZES - 1);
+        signed char decision = decisions[table_index(log_m, log_ratio, span_class(shape.smaller_size, shape.smaller_span))];
+        if (decision < 0) {
+            return false;
+        }
+        strategy = (IntersectionStrategy)decision;
+        return true;
+    }
+
+    double cost(IntersectionStrategy strategy, const IntersectionShape &shape) const {
+        double m = shape.smaller_size;
+        double n = shape.larger_size;
+        double log_m = log2(m + 1);
+        double sort_cost = shape.smaller_sorted ? 0 : sort_element * m * log_m;
+
+        switch (strategy) {
+            case IntersectionStrategy::by_find:
+                if (shape.smaller_size <= MAX_FIXED_FIND_SIZE) {
+                    return fixed_find_compare * fixed_find_size(shape.smaller_size) * n;
+                }
+                return find_compare * m * n;
+            case IntersectionStrategy::by_hash:
+                return hash_build * m + hash_probe * n;
+            case IntersectionStrategy::by_sort:
+                return sort_cost + search_step * n * log_m;
+            case IntersectionStrategy::by_merge:
+                if (!shape.larger_sorted) {
+                    return HUGE_VAL;
+                }
+                return sort_cost + merge_step * (m + n);
+            case IntersectionStrategy::by_bitmap:
+                if (shape.smaller_span >= MAX_BITMAP_SPAN) {
+                    return HUGE_VAL;
+                }
+                return bitmap_word * (shape.smaller_span / 64 + 1) + bitmap_build * m + bitmap_probe * n;
+            case IntersectionStrategy::by_eytzinger:
+                if (shape.smaller_size > EYTZINGER_CACHED_SIZE) {
+                    return sort_cost + eytzinger_cold_step * n * log_m;
+                }
+                return sort_cost + eytzinger_step * n * log_m;
+        }
+        return HUGE_VAL;
+    }
+
+    IntersectionStrategy choose(const IntersectionShape &shape) const {
+        IntersectionStrategy best = IntersectionStrategy::by_find;
+        if (lookup(shape, best) && cost(best, shape) != HUGE_VAL) {
+            return best;
+        }
+        best = IntersectionStrategy::by_find;
+        for (int i = 1; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+            IntersectionStrategy strategy = (IntersectionStrategy)i;
+            if (cost(strategy, shape) < cost(best, shape)) {
+                best = strategy;
+            }
+        }
+        return best;
+    }
+
+    // Только by_find и by_hash: у них есть версии с ранней остановкой. by_find с остановкой -
+    // обычный цикл с find, без ядер фиксированного размера, поэтому и цена у него обычная.
+    IntersectionStrategy choose_find_or_hash(size_t smaller_size, size_t larger_size) const {
+        IntersectionShape shape;
+        shape.smaller_size = smaller_size;
+        shape.larger_size = larger_size;
+        if (find_compare * smaller_size * larger_size <= cost(IntersectionStrategy::by_hash, shape)) {
+            return IntersectionStrategy::by_find;
+        }
+        return IntersectionStrategy::by_hash;
+    }
+
+    // Профиль - текстовый файл из строк вида "coef <имя> <значение>"
+    // и "table <log2 m> <log2 (n / m)> <класс диапазона> <алгоритм>".
+    // Незнакомые строки пропускаются, отсутствующие коэффициенты остаются прежними.
+    bool load(const string &path) {
+        ifstream in(path);
+        if (!in) {
+            return false;
+        }
+        string line;
+        while (getline(in, line)) {
+            istringstream words(line);
+            string kind, name;
+            words >> kind;
+            if (kind == "coef") {
+                double value;
+                if (words >> name >> value) {
+                    if (double *coef = find_coef(name)) {
+                        *coef = value;
+                    }
+                }
+            } else if (kind == "table") {
+                int log_m, log_ratio, span_cls;
+                IntersectionStrategy strategy;
+                if (words >> log_m >> log_ratio >> span_cls >> name && strategy_from_name(name, strategy)
+                        && in_table(log_m, log_ratio, span_cls)) {
+                    set_decision(log_m, log_ratio, span_cls, strategy);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool save(const string &path) const {
+        ofstream out(path);
+        out << "# vk_db_count_intersection profile v1\n";
+        for (auto &named : coefs()) {
+            out << "coef " << named.first << " " << this->*named.second << "\n";
+        }
+        for (int log_m = 0; log_m < TABLE_LOG_SIZES && !decisions.empty(); log_m++) {
+            for (int log_ratio = 0; log_ratio < TABLE_LOG_SIZES; log_ratio++) {
+                for (int span_cls = 0; span_cls < TABLE_SPAN_CLASSES; span_cls++) {
+                    signed char decision = decisions[table_index(log_m, log_ratio, span_cls)];
+                    if (decision >= 0) {
+                        out << "table " << log_m << " " << log_ratio << " " << span_cls << " "
+                            << strategy_name((IntersectionStrategy)decision) << "\n";
+                    }
+                }
+            }
+        }
+        return bool(out);
+    }
+
+    // Быстрый микробенчмарк на несколько миллисекунд.
+    static IntersectionCostModel calibrate();
+
+private:
+    static bool in_table(int log_m, int log_ratio, int span_cls) {
+        return 0 <= log_m && log_m < TABLE_LOG_SIZES && 0 <= log_ratio && log_ratio < TABLE_LOG_SIZES
+            && 0 <= span_cls && span_cls < TABLE_SPAN_CLASSES;
+    }
+
+    static int table_index(int log_m, int log_ratio, int span_cls) {
+        return (log_m * TABLE_LOG_SIZES + log_ratio) * TABLE_SPAN_CLASSES + span_cls;
+    }
+
+    static const vector<pair<string, double IntersectionCostModel::*>> &coefs() {
+        static const vector<pair<string, double IntersectionCostModel::*>> all = {
+            {"find_compare", &IntersectionCostModel::find_compare},
+            {"fixed_find_compare", &IntersectionCostModel::fixed_find_compare},
+            {"hash_build", &IntersectionCostModel::hash_build},
+            {"hash_probe", &IntersectionCostModel::hash_probe},
+            {"sort_element", &IntersectionCostModel::sort_element},
+            {"search_step", &IntersectionCostModel::search_step},
+            {"merge_step", &IntersectionCostModel::merge_step},
+            {"bitmap_word", &IntersectionCostModel::bitmap_word},
+            {"bitmap_build", &IntersectionCostModel::bitmap_build},
+            {"bitmap_probe", &IntersectionCostModel::bitmap_probe},
+            {"eytzinger_step", &IntersectionCostModel::eytzinger_step},
+            {"eytzinger_cold_step", &IntersectionCostModel::eytzinger_cold_step},
+        };
+        return all;
+    }
+
+    double *find_coef(const string &name) {
+        for (auto &named : coefs()) {
+            if (named.first == name) {
+                return &(this->*named.second);
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Минимальное время из нескольких запусков в наносекундах.
+template <class Function>
+double measure_min_ns(Function function, int repetitions) {
+    double best = HUGE_VAL;
+    for (int r = 0; r < repetitions; r++) {
+        auto start = chrono::steady_clock::now();
+        volatile int result = function(); // чтобы компилятор не выкинул замеряемый вызов
+        (void)result;
+        auto finish = chrono::steady_clock::now();
+        best = min(best, (double)chrono::duration_cast<chrono::nanoseconds>(finish - start).count());
+    }
+    return best;
+}
+
+inline IntersectionCostModel IntersectionCostModel::calibrate() {
+    const int REPETITIONS = 5;
+    const int M = 1 << 12;
+    const int N = 1 << 15;
+    const int FIND_M = 64;
+    const int EYTZINGER_COLD_M = 1 << 17;
+    const double MIN_COEF = 1e-3;
+
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(0, 4 * N);
+    vector<int> smaller(M), larger(N), small(FIND_M);
+    for (auto &e : smaller) e = uid(gen);
+    for (auto &e : larger) e = uid(gen);
+    for (auto &e : small) e = uid(gen);
+    vector<int> larger_prefix(begin(larger), begin(larger) + M);
+    vector<int> sorted_smaller(smaller), sorted_larger(larger);
+    sort(begin(sorted_smaller), end(sorted_smaller));
+    sort(begin(sorted_larger), end(sorted_larger));
+    double log_m = log2(M + 1);
+
+    // Время probe считаем по разности двух запусков с разным larger, остаток - построение.
+    auto split = [&](double time_n, double time_m, double &build, double &probe) {
+        probe = max(MIN_COEF, (time_n - time_m) / (N - M));
+        build = max(MIN_COEF, (time_m - probe * M) / M);
+    };
+
+    IntersectionCostModel model;
+
+    model.find_compare = max(MIN_COEF, measure_min_ns([&] {
+        return count_intersection_by_find(small, larger);
+    }, REPETITIONS) / ((double)FIND_M * N));
+
+    model.fixed_find_compare = max(MIN_COEF, measure_min_ns([&] {
+        return count_intersection_by_find_small(small, larger);
+    }, REPETITIONS) / ((double)FIND_M * N));
+
+    split(measure_min_ns([&] { return count_intersection_by_hash(smaller, larger); }, REPETITIONS),
+          measure_min_ns([&] { return count_intersection_by_hash(smaller, larger_prefix); }, REPETITIONS),
+          model.hash_build, model.hash_probe);
+
+    model.search_step = max(MIN_COEF, measure_min_ns([&] {
+        return count_intersection_by_binary_search(sorted_smaller, larger);
+    }, REPETITIONS) / (N * log_m));
+
+    model.eytzinger_step = max(MIN_COEF, measure_min_ns([&] {
+        return count_intersection_by_eytzinger(IntArrayView(sorted_smaller.data(), M, true), larger);
+    }, REPETITIONS) / (N * log_m));
+
+    // Дерево побольше, чтобы оно точно вылезло из L1. Длиннее larger ему быть не мешает.
+    vector<int> cold_tree(EYTZINGER_COLD_M);
+    for (size_t i = 0; i < cold_tree.size(); i++) {
+        cold_tree[i] = 2 * (int)i;
+    }
+    model.eytzinger_cold_step = max(MIN_COEF, measure_min_ns([&] {
+        return count_intersection_by_eytzinger(IntArrayView(cold_tree.data(), cold_tree.size(), true), larger);
+    }, REPETITIONS) / (N * log2(EYTZINGER_COLD_M + 1)));
+
+    double sort_total = measure_min_ns([&] {
+        return count_intersection_by_sort(smaller, larger_prefix);
+    }, REPETITIONS);
+    model.sort_element = max(MIN_COEF, (sort_total - model.search_step * M * log_m) / (M * log_m));
+
+    model.merge_step = max(MIN_COEF, measure_min_ns([&] {
+        return count_intersection_by_merge(sorted_smaller, sorted_larger);
+    }, REPETITIONS) / (M + N));
+
+    // Диапазон значений 4 * N, т.е. 2 * N / 32 слов маски - порядка M, этим и пренебрегаем.
+    split(measure_min_ns([&] { return count_intersection_by_bitmap(smaller, larger); }, REPETITIONS),
+          measure_min_ns([&] { return count_intersection_by_bitmap(smaller, larger_prefix); }, REPETITIONS),
+          model.bitmap_build, model.bitmap_probe);
+    model.bitmap_word = model.bitmap_build / 8;
+
+    return model;
+}
+
+// Модель, которой пользуется count_intersection. Если задана переменная окружения
+// VK_DB_INTERSECTION_PROFILE, то читаем профиль из файла, иначе калибруемся при первом вызове.
+inline IntersectionCostModel &intersection_cost_model() {
+    static IntersectionCostModel model = [] {
+        IntersectionCostModel loaded;
+        const char *path = getenv("VK_DB_INTERSECTION_PROFILE");
+        if (path && loaded.load(path)) {
+            return loaded;
+        }
+        return IntersectionCostModel::calibrate();
+    }();
+    return model;
+}
+
+// Для случаев, когда модель нужно подменить целиком. Вызывать до запуска запросов.
+inline void set_intersection_cost_model(const IntersectionCostModel &model) {
+    intersection_cost_model() = model;
+}
+
+// Считаем что 0 < smaller.size() <= larger.size().
+inline IntersectionStrategy choose_intersection_strategy(IntArrayView smaller, IntArrayView larger) {
+    return intersection_cost_model().choose(describe_intersection(smaller, larger));
+}
+
+inline int run_intersection_strategy(IntersectionStrategy strategy, const IntersectionShape &shape,
+                                     IntArrayView smaller, IntArrayView larger) {
+    switch (strategy) {
+        case IntersectionStrategy::by_find:
+            if (smaller.size() <= MAX_FIXED_FIND_SIZE) {
+                return count_intersection_by_find_small(smaller, larger);
+            }
+            return count_intersection_by_find(smaller, larger);
+        case IntersectionStrategy::by_hash:
+            return count_intersection_by_hash(smaller, larger);
+        case IntersectionStrategy::by_sort:
+            if (shape.smaller_sorted) {
+                return count_intersection_by_binary_search(smaller, larger);
+            }
+            return count_intersection_by_sort(smaller, larger);
+        case IntersectionStrategy::by_merge:
+            if (shape.smaller_sorted) {
+                return count_intersection_by_merge(smaller, larger);
+            } else {
+                vector<int> smaller_cp(begin(smaller), end(smaller));
+                sort(begin(smaller_cp), end(smaller_cp));
+                return count_intersection_by_merge(smaller_cp, larger);
+            }
+        case IntersectionStrategy::by_bitmap:
+            return count_intersection_by_bitmap(smaller, larger);
+        case IntersectionStrategy::by_eytzinger:
+            return count_intersection_by_eytzinger(IntArrayView(smaller.data(), smaller.size(), shape.smaller_sorted),
+                                                   larger);
+    }
+    return count_intersection_by_hash(smaller, larger);
+}
+
+// Аппаратные счетчики по алгоритмам. По умолчанию выключены: включение стоит
+// нескольких системных вызовов на каждый запрос.
+
+struct KernelPerfStats {
+    uint64_t calls = 0;
+    uint64_t elements = 0; // сумма m + n по всем запросам
+    PerfCounts counts;
+};
+
+struct KernelPerfRegistry {
+    atomic<bool> enabled{false};
+    mutex lock;
+    KernelPerfStats stats[INTERSECTION_STRATEGIES_COUNT];
+};
+
+inline KernelPerfRegistry &kernel_perf_registry() {
+    static KernelPerfRegistry registry;
+    return registry;
+}
+
+// Счетчики меряют только свой поток, поэтому у каждого потока своя группа.
+inline PerfCounterGroup &thread_perf_counters() {
+    static thread_local PerfCounterGroup group;
+    return group;
+}
+
+inline bool kernel_perf_counters_available() {
+    return thread_perf_counters().available();
+}
+
+inline void set_kernel_perf_counters_enabled(bool enabled) {
+    kernel_perf_registry().enabled.store(enabled, memory_order_relaxed);
+}
+
+inline KernelPerfStats kernel_perf_stats(IntersectionStrategy strategy) {
+    KernelPerfRegistry &registry = kernel_perf_registry();
+    lock_guard<mutex> guard(registry.lock);
+    return registry.stats[(int)strategy];
+}
+
+inline void reset_kernel_perf_stats() {
+    KernelPerfRegistry &registry = kernel_perf_registry();
+    lock_guard<mutex> guard(registry.lock);
+    for (auto &stats : registry.stats) {
+        stats = KernelPerfStats();
+    }
+}
+
+// Телеметрия всех вызовов count_intersection_with, см. telemetry.hpp.
+static_assert(INTERSECTION_STRATEGIES_COUNT <= TELEMETRY_MAX_STRATEGIES, "telemetry has no slot for a strategy");
+
+inline Telemetry &intersection_telemetry() {
+    return Telemetry::instance();
+}
+
+// Запуск выбранного алгоритма. Считаем что 0 < smaller.size() <= larger.size().
+inline int count_intersection_with(IntersectionStrategy strategy, const IntersectionShape &shape,
+                                   IntArrayView smaller, IntArrayView larger) {
+    size_t elements = smaller.size() + larger.size();
+    Telemetry &telemetry = intersection_telemetry();
+    telemetry.record_call((int)strategy, elements * sizeof(int));
+
+    KernelPerfRegistry &registry = kernel_perf_registry();
+    bool perf = registry.enabled.load(memory_order_relaxed);
+    bool latency = telemetry.latency_enabled();
+    if (!perf && !latency) {
+        return run_intersection_strategy(strategy, shape, smaller, larger);
+    }
+
+    PerfCounterGroup *group = perf ? &thread_perf_counters() : nullptr;
+    if (group) {
+        group->start();
+    }
+    auto start = chrono::steady_clock::now();
+    int ans = run_intersection_strategy(strategy, shape, smaller, larger);
+    auto finish = chrono::steady_clock::now();
+
+    if (latency) {
+        telemetry.record_latency((int)strategy, elements,
+                                 chrono::duration_cast<chrono::nanoseconds>(finish - start).count());
+    }
+    if (group) {
+        PerfCounts counts = group->stop();
+        lock_guard<mutex> guard(registry.lock);
+        KernelPerfStats &stats = registry.stats[(int)strategy];
+        ++stats.calls;
+        stats.elements += elements;
+        stats.counts += counts;
+    }
+    return ans;
+}
+
+// Полное решение
+inline int count_intersection(IntArrayView first_array, IntArrayView second_array) {
+
+    if (min(first_array.size(), second_array.size()) == 0) {
+        return 0;
+    }
+
+    IntArrayView smaller = first_array;
+    IntArrayView larger = second_array;
+    if (smaller.size() > larger.size()) {
+        swap(smaller, larger);
+    }
+
+    IntersectionShape shape = describe_intersection(smaller, larger);
+    IntersectionStrategy strategy = intersection_cost_model().choose(shape);
+
+    return count_intersection_with(strategy, shape, smaller, larger);
+}
+
+// Запросы с порогом. Часто нужно знать только "есть ли хотя бы k общих элементов",
+// поэтому не обязательно просматривать весь larger.
+
+// Считает пересечение, но не больше limit: как только нашли limit общих элементов, останавливаемся.
+// Считаем что 0 < smaller.size() <= larger.size().
+inline int count_intersection_by_hash_bounded(IntArrayView smaller, IntArrayView larger, int limit) {
+    return with_empty_hash_set(2 * smaller.size(), [&](FastIntHashSet &hash_set) {
+        int ans = 0;
+
+        for (auto e : smaller) {
+            hash_set.add(e);
+        }
+
+        for (auto e : larger) {
+            ans += hash_set.contains(e);
+            if (ans >= limit) {
+                break;
+            }
+        }
+        return ans;
+    });
+}
+
+inline int count_intersection_by_find_bounded(IntArrayView smaller, IntArrayView larger, int limit) {
+    int ans = 0;
+
+    for (auto e : larger) {
+        ans += (find(begin(smaller), end(smaller), e) != end(smaller));
+        if (ans >= limit) {
+            break;
+        }
+    }
+
+    return ans;
+}
+
+// Есть ли хотя бы k общих элементов. Кроме остановки на k-м совпадении, останавливаемся,
+// когда даже если все оставшиеся элементы larger совпадут, k уже не набрать.
+// Считаем что 0 < smaller.size() <= larger.size().
+inline bool count_intersection_by_hash_at_least(IntArrayView smaller, IntArrayView larger, int k) {
+    return with_empty_hash_set(2 * smaller.size(), [&](FastIntHashSet &hash_set) {
+        int ans = 0;
+
+        for (auto e : smaller) {
+            hash_set.add(e);
+        }
+
+        int remaining = larger.size();
+        for (auto e : larger) {
+            if (ans + remaining < k) {
+                return false;
+            }
+            --remaining;
+            ans += hash_set.contains(e);
+            if (ans >= k) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+inline bool count_intersection_by_find_at_least(IntArrayView smaller, IntArrayView larger, int k) {
+    int ans = 0;
+
+    int remaining = larger.size();
+    for (auto e : larger) {
+        if (ans + remaining < k) {
+            return false;
+        }
+        --remaining;
+        ans += (find(begin(smaller), end(smaller), e) != end(smaller));
+        if (ans >= k) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Полное решение с порогом: возвращает min(count_intersection(first_array, second_array), limit).
+inline int count_intersection_bounded(IntArrayView first_array, IntArrayView second_array, int limit) {
+
+    if (limit <= 0 || min(first_array.size(), second_array.size()) == 0) {
+        return 0;
+    }
+
+    IntArrayView smaller = first_array;
+    IntArrayView larger = second_array;
+    if (smaller.size() > larger.size()) {
+        swap(smaller, larger);
+    }
+
+    IntersectionStrategy strategy =
+        intersection_cost_model().choose_find_or_hash(smaller.size(), larger.size());
+    if (strategy == IntersectionStrategy::by_find) {
+        return count_intersection_by_find_bounded(smaller, larger, limit);
+    }
+
+    return count_intersection_by_hash_bounded(smaller, larger, limit);
+}
+
+// count_intersection(first_array, second_array) >= k
+inline bool count_intersection_at_least(IntArrayView first_array, IntArrayView second_array, int k) {
+
+    if (k <= 0) {
+        return true;
+    }
+
+    IntArrayView smaller = first_array;
+    IntArrayView larger = second_array;
+    if (smaller.size() > larger.size()) {
+        swap(smaller, larger);
+    }
+
+    // Массивы - множества, так что общих элементов не больше, чем в smaller.
+    if (smaller.size() < (size_t)k) {
+        return false;
+    }
+
+    IntersectionStrategy strategy =
+        intersection_cost_model().choose_find_or_hash(smaller.size(), larger.size());
+    if (strategy == IntersectionStrategy::by_find) {
+        return count_intersection_by_find_at_least(smaller, larger, k);
+    }
+
+    return count_intersection_by_hash_at_least(smaller, larger, k);
+}
+
+// count_intersection(first_array, second_array) < k
+inline bool count_intersection_less_than(IntArrayView first_array, IntArrayView second_array, int k) {
+    return !count_intersection_at_least(first_array, second_array, k);
+}
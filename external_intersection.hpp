@@ -0,0 +1,412 @@
+#pragma once
+
+// Пересечение, когда в память не помещается ни один из входов (десятки гигабайт).
+//
+// 1. Каждый вход читается последовательно (StreamChunkReader) и раскладывается по P
+//    временным файлам по хешу значения. Одинаковые значения попадают в файлы с одним номером.
+// 2. Пары файлов с одинаковым номером пересекаются независимо и параллельно: меньший файл
+//    пары - в хеш-таблицу, больший читается кусками.
+// P подбирается так, чтобы таблицы всех рабочих потоков уместились в memory_budget. Если для этого
+// нужно больше EXTERNAL_MAX_PARTITIONS частей, пара, меньшая часть которой не влезает в долю
+// бюджета одного потока, раскладывается заново по следующим битам хеша, и так до тех пор,
+// пока части не станут достаточно малы.
+//
+// Временные файлы создаются в temp_dir и сразу удаляются из каталога, так что после
+// завершения (в том числе аварийного) на диске ничего не остается.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "count_intersection.hpp"
+#include "stream_intersection.hpp"
+
+struct ExternalIntersectionOptions {
+    string temp_dir = "/tmp";
+    size_t memory_budget = 256 << 20;
+    int threads = 0;       // 0 - по числу ядер
+    size_t partitions = 0; // 0 - подобрать по размеру входов и memory_budget
+};
+
+// Чтение и запись временных файлов идут блоками такого размера.
+const size_t EXTERNAL_IO_BYTES = 1 << 20;
+// Больше файлов на одном уровне разбиения не открываем: на каждый нужен дескриптор и буфер записи.
+const int EXTERNAL_MAX_PARTITION_BITS = 8;
+const size_t EXTERNAL_MAX_PARTITIONS = size_t(1) << EXTERNAL_MAX_PARTITION_BITS;
+// Если размер входа неизвестен (pipe), а число частей не задано.
+const size_t EXTERNAL_DEFAULT_PARTITIONS = 64;
+// Байт на элемент меньшей части в хеш-таблице: емкость 2 * count, по int и байту тега на слот.
+const size_t EXTERNAL_BYTES_PER_ELEMENT = 2 * (sizeof(int) + 1);
+
+struct ExternalIntersectionStats {
+    uint64_t largest_partition = 0; // элементов в самой большой хеш-таблице
+    uint64_t repartitioned = 0;     // пар частей, разложенных повторно
+};
+
+// Номер части по bits битам мультипликативного хеша, начиная с shift-го старшего: повторное
+// разбиение берет следующие биты. FastIntHashSet берет старшие биты good_hash, так что значения
+// одной части не скапливаются в одних и тех же слотах таблицы.
+inline size_t external_partition(int value, int shift, int bits) {
+    return bits == 0 ? 0 : (((uint32_t)value * 0x9E3779B1u) << shift) >> (32 - bits);
+}
+
+// Наименьшее число бит, дающее не меньше partitions частей (не больше 32).
+inline int external_bits_for(uint64_t partitions) {
+    int bits = 0;
+    while (bits < 32 && (uint64_t(1) << bits) < partitions) {
+        ++bits;
+    }
+    return bits;
+}
+
+inline bool write_all(int fd, const void *data, size_t bytes) {
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+        ssize_t done = ::write(fd, p, bytes);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        p += done;
+        bytes -= done;
+    }
+    return true;
+}
+
+inline bool pread_all(int fd, void *data, size_t bytes, uint64_t offset) {
+    char *p = static_cast<char *>(data);
+    while (bytes > 0) {
+        ssize_t done = ::pread(fd, p, bytes, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        p += done;
+        bytes -= done;
+        offset += done;
+    }
+    return true;
+}
+
+// Временные файлы одного входа с буферами записи. Не копируется, так как владеет дескрипторами.
+class SpillPartitions {
+public:
+    struct Part {
+        int fd = -1;
+        uint64_t count = 0;
+        vector<int> buffer;
+    };
+
+    SpillPartitions(const string &temp_dir, int shift, int bits, size_t buffer_elements)
+        : _shift(shift), _bits(bits), _parts(size_t(1) << bits) {
+        for (auto &part : _parts) {
+            string name = temp_dir + "/vk_db_spill_XXXXXX";
+            part.fd = mkstemp(&name[0]);
+            if (part.fd < 0) {
+                _error = temp_dir + ": " + strerror(errno);
+                return;
+            }
+            unlink(name.c_str());
+            part.buffer.reserve(buffer_elements);
+        }
+    }
+
+    SpillPartitions(const SpillPartitions &) = delete;
+    SpillPartitions &operator=(const SpillPartitions &) = delete;
+
+    ~SpillPartitions() {
+        for (auto &part : _parts) {
+            if (part.fd >= 0) {
+                close(part.fd);
+            }
+        }
+    }
+
+    bool add(IntArrayView values) {
+        for (auto e : values) {
+            Part &part = _parts[external_partition(e, _shift, _bits)];
+            part.buffer.push_back(e);
+            if (part.buffer.size() == part.buffer.capacity() && !flush(part)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool flush() {
+        for (auto &part : _parts) {
+            if (!flush(part)) {
+                return false;
+            }
+        }
+        // Буферы записи больше не нужны, освобождаем память под таблицы.
+        for (auto &part : _parts) {
+            vector<int>().swap(part.buffer);
+        }
+        return true;
+    }
+
+    const vector<Part> &parts() const {
+        return _parts;
+    }
+
+    const string &error() const {
+        return _error;
+    }
+
+private:
+    int _shift;
+    int _bits;
+    vector<Part> _parts;
+    string _error;
+
+    bool flush(Part &part) {
+        if (!write_all(part.fd, part.buffer.data(), part.buffer.size() * sizeof(int))) {
+            _error = string("can't write spill file: ") + strerror(errno);
+            return false;
+        }
+        part.count += part.buffer.size();
+        part.buffer.clear();
+        return true;
+    }
+};
+
+// Читает весь вход и раскладывает его по частям.
+inline bool spill_input(int fd, SpillPartitions &partitions, string &error) {
+    if (!partitions.error().empty()) {
+        error = partitions.error();
+        return false;
+    }
+    StreamChunkReader reader(fd, EXTERNAL_IO_BYTES / sizeof(int));
+    for (IntArrayView chunk = reader.next(); !chunk.empty(); chunk = reader.next()) {
+        if (!partitions.add(chunk)) {
+            error = partitions.error();
+            return false;
+        }
+    }
+    if (reader.failed()) {
+        error = reader.error();
+        return false;
+    }
+    if (!partitions.flush()) {
+        error = partitions.error();
+        return false;
+    }
+    return true;
+}
+
+// Читает count значений части кусками по EXTERNAL_IO_BYTES и отдает их в function(IntArrayView).
+template <class Function>
+bool read_part(const SpillPartitions::Part &part, vector<int> &buffer, Function function) {
+    for (uint64_t done = 0; done < part.count; ) {
+        size_t count = (size_t)min<uint64_t>(buffer.size(), part.count - done);
+        if (!pread_all(part.fd, buffer.data(), count * sizeof(int), done * sizeof(int))) {
+            return false;
+        }
+        function(IntArrayView(buffer.data(), count));
+        done += count;
+    }
+    return true;
+}
+
+// Раскладывает уже записанную часть по следующим битам хеша.
+inline bool spill_part(const SpillPartitions::Part &part, vector<int> &buffer, SpillPartitions &partitions,
+                       string &error) {
+    if (!partitions.error().empty()) {
+        error = partitions.error();
+        return false;
+    }
+    bool added = true;
+    if (!read_part(part, buffer, [&](IntArrayView values) { added = added && partitions.add(values); })) {
+        error = string("can't read spill file: ") + strerror(errno);
+        return false;
+    }
+    if (!added || !partitions.flush()) {
+        error = partitions.error();
+        return false;
+    }
+    return true;
+}
+
+// Буфер записи одной части: буферы одного входа вместе занимают не больше четверти budget.
+inline size_t external_buffer_elements(size_t budget, int bits) {
+    return min(max(budget / 4 / (size_t(1) << bits), (size_t)4096), EXTERNAL_IO_BYTES) / sizeof(int);
+}
+
+// Пересечение пар частей в одном рабочем потоке.
+struct ExternalPairIntersector {
+    string temp_dir;
+    size_t per_thread = 1; // байт на хеш-таблицу одного потока
+    vector<int> buffer = vector<int>(EXTERNAL_IO_BYTES / sizeof(int));
+    uint64_t count = 0;
+    ExternalIntersectionStats stats;
+    string error;
+
+    // Пересекает пару частей с одинаковым номером; shift - сколько старших бит хеша уже
+    // использовано, wanted_bits - сколько еще бит разбиения запрошено через options.partitions.
+    // Если меньшая часть не помещается в per_thread, пара раскладывается по следующим битам.
+    bool intersect(const SpillPartitions::Part &part_a, const SpillPartitions::Part &part_b, int shift,
+                   int wanted_bits) {
+        const SpillPartitions::Part *build = &part_a, *probe = &part_b;
+        if (build->count > probe->count) {
+            swap(build, probe);
+        }
+        if (build->count == 0) {
+            return true;
+        }
+        uint64_t needed = (build->count * EXTERNAL_BYTES_PER_ELEMENT + per_thread - 1) / per_thread;
+        int bits = min(min(max(wanted_bits, external_bits_for(needed)), EXTERNAL_MAX_PARTITION_BITS), 32 - shift);
+        if (bits > 0) {
+            stats.repartitioned++;
+            size_t buffer_elements = external_buffer_elements(per_thread, bits);
+            SpillPartitions a(temp_dir, shift, bits, buffer_elements);
+            SpillPartitions b(temp_dir, shift, bits, buffer_elements);
+            if (!spill_part(*build, buffer, a, error) || !spill_part(*probe, buffer, b, error)) {
+                return false;
+            }
+            for (size_t p = 0; p < a.parts().size(); p++) {
+                if (!intersect(a.parts()[p], b.parts()[p], shift + bits, wanted_bits - bits)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        // Слишком большая часть остается, только когда все 32 бита хеша использованы,
+        // то есть когда значения входа повторяются.
+        if (2 * build->count > MAX_HASH_SET_CAPACITY) {
+            error = "partition is too large for a hash table, input values are not distinct";
+            return false;
+        }
+        stats.largest_partition = max(stats.largest_partition, build->count);
+        bool ok = with_empty_hash_set(2 * build->count, [&](FastIntHashSet &hash_set) {
+            return read_part(*build, buffer, [&](IntArrayView values) {
+                for (auto e : values) {
+                    hash_set.add(e);
+                }
+            }) && read_part(*probe, buffer, [&](IntArrayView values) {
+                count += hash_set.count_contained(values);
+            });
+        });
+        if (!ok) {
+            error = string("can't read spill file: ") + strerror(errno);
+        }
+        return ok;
+    }
+};
+
+// Сколько бит хеша нужно на все разбиение: по options.partitions или по размеру меньшего входа
+// и memory_budget. Первый уровень использует не больше EXTERNAL_MAX_PARTITION_BITS из них.
+inline int external_partition_bits(int fd_a, int fd_b, const ExternalIntersectionOptions &options, int threads) {
+    size_t partitions = options.partitions;
+    if (partitions == 0) {
+        // Размер берем у того входа, у которого он известен; части строятся по меньшему.
+        uint64_t elements = UINT64_MAX;
+        for (int fd : {fd_a, fd_b}) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                elements = min<uint64_t>(elements, st.st_size / sizeof(int));
+            }
+        }
+        if (elements == UINT64_MAX) {
+            partitions = EXTERNAL_DEFAULT_PARTITIONS;
+        } else {
+            size_t per_thread = max<size_t>(options.memory_budget / threads, 1);
+            partitions = (size_t)((elements * EXTERNAL_BYTES_PER_ELEMENT + per_thread - 1) / per_thread);
+        }
+    }
+    return external_bits_for(partitions);
+}
+
+// Число общих элементов двух потоков int32 (см. stream_intersection.hpp). Значения внутри
+// каждого входа считаются различными. false при ошибке ввода-вывода, причина в *error.
+inline bool count_intersection_external(int fd_a, int fd_b, uint64_t &count,
+                                        const ExternalIntersectionOptions &options = ExternalIntersectionOptions(),
+                                        string *error = nullptr, ExternalIntersectionStats *stats = nullptr) {
+    count = 0;
+    int threads = options.threads > 0 ? options.threads : max(1, (int)thread::hardware_concurrency());
+    int wanted_bits = external_partition_bits(fd_a, fd_b, options, threads);
+    int bits = min(wanted_bits, EXTERNAL_MAX_PARTITION_BITS);
+    size_t buffer_elements = external_buffer_elements(options.memory_budget, bits);
+
+    string failure;
+    SpillPartitions a(options.temp_dir, 0, bits, buffer_elements);
+    SpillPartitions b(options.temp_dir, 0, bits, buffer_elements);
+    bool ok = spill_input(fd_a, a, failure) && spill_input(fd_b, b, failure);
+
+    atomic<size_t> next_part(0);
+    atomic<uint64_t> total(0);
+    mutex failure_lock;
+    ExternalIntersectionStats total_stats;
+    auto worker = [&] {
+        ExternalPairIntersector intersector;
+        intersector.temp_dir = options.temp_dir;
+        intersector.per_thread = max<size_t>(options.memory_budget / threads, 1);
+        for (size_t p = next_part++; p < a.parts().size(); p = next_part++) {
+            if (!intersector.intersect(a.parts()[p], b.parts()[p], bits, wanted_bits - bits)) {
+                lock_guard<mutex> guard(failure_lock);
+                failure = intersector.error;
+                next_part = a.parts().size();
+            }
+        }
+        total += intersector.count;
+        lock_guard<mutex> guard(failure_lock);
+        total_stats.largest_partition = max(total_stats.largest_partition, intersector.stats.largest_partition);
+        total_stats.repartitioned += intersector.stats.repartitioned;
+    };
+
+    if (ok) {
+        vector<thread> pool;
+        for (int t = 1; t < threads; t++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (auto &t : pool) {
+            t.join();
+        }
+        ok = failure.empty();
+    }
+
+    if (!ok && error) {
+        *error = failure;
+    }
+    if (stats) {
+        *stats = total_stats;
+    }
+    count = total;
+    return ok;
+}
+
+inline bool count_intersection_external(const string &path_a, const string &path_b, uint64_t &count,
+                                        const ExternalIntersectionOptions &options = ExternalIntersectionOptions(),
+                                        string *error = nullptr, ExternalIntersectionStats *stats = nullptr) {
+    int fd_a = ::open(path_a.c_str(), O_RDONLY);
+    int fd_b = ::open(path_b.c_str(), O_RDONLY);
+    bool ok = false;
+    if (fd_a < 0 || fd_b < 0) {
+        if (error) {
+            *error = (fd_a < 0 ? path_a : path_b) + ": " + strerror(errno);
+        }
+    } else {
+        ok = count_intersection_external(fd_a, fd_b, count, options, error, stats);
+    }
+    if (fd_a >= 0) {
+        ::close(fd_a);
+    }
+    if (fd_b >= 0) {
+        ::close(fd_b);
+    }
+    return ok;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+// Снимок построенной FastIntHashSet в файле, который открывается через mmap и сразу готов
+// к поиску, без повторного хеширования. Запуск сервиса с сотнями миллионов ключей упирается
+// только в подгрузку страниц, а несколько процессов, открывших один снимок, делят его
+// страницы через page cache.
+//
+// Раскладка файла:
+//   [0, 64)                    HashSetSnapshotHeader
+//   [slots_offset, ...)        capacity значений int32
+//   [tags_offset, ...)         capacity байт меток: слот занят, если метка равна epoch
+// Оба смещения кратны 64. Таблица восстанавливается только с той же хеш-функцией
+// и схемой пробирования, поэтому они записаны в заголовке.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "count_intersection.hpp"
+#include "int_set_file.hpp"
+
+const char HASH_SET_SNAPSHOT_MAGIC[8] = {'V', 'K', 'H', 'S', 'N', 'A', 'P', 'S'};
+const uint32_t HASH_SET_SNAPSHOT_VERSION = 1;
+// good_hash(x) % capacity и линейное пробирование. Так строились таблицы раньше, такие снимки не открываем.
+const uint32_t HASH_SET_GOOD_HASH_LINEAR = 1;
+// FastIntHashSet::home_slot (старшие биты good_hash(x) * capacity) и линейное пробирование.
+const uint32_t HASH_SET_GOOD_HASH_FASTRANGE_LINEAR = 2;
+
+struct HashSetSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_function;
+    uint64_t capacity;
+    uint64_t size;
+    uint32_t epoch;
+    uint32_t padding;
+    uint64_t slots_offset;
+    uint64_t tags_offset;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(HashSetSnapshotHeader) == INT_SET_FILE_ALIGNMENT, "header must fill exactly one cache line");
+
+// Метки в файле нормализуются: занятые слоты получают метку 1, остальные 0, так что
+// устаревшие метки прошлых поколений в снимок не попадают.
+inline bool save_hash_set_snapshot(const FastIntHashSet &hash_set, const string &path) {
+    size_t capacity = hash_set.capacity();
+    HashSetSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HASH_SET_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = HASH_SET_SNAPSHOT_VERSION;
+    header.hash_function = HASH_SET_GOOD_HASH_FASTRANGE_LINEAR;
+    header.capacity = capacity;
+    header.size = hash_set.size();
+    header.epoch = 1;
+    header.slots_offset = INT_SET_FILE_ALIGNMENT;
+    size_t slots_end = header.slots_offset + capacity * sizeof(int);
+    header.tags_offset = align_up(slots_end, INT_SET_FILE_ALIGNMENT);
+
+    vector<uint8_t> tags(capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        tags[i] = hash_set.tags()[i] == hash_set.epoch();
+    }
+
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    static const char zeros[INT_SET_FILE_ALIGNMENT] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(hash_set.slots(), sizeof(int), capacity, out) == capacity
+        && fwrite(zeros, 1, header.tags_offset - slots_end, out) == header.tags_offset - slots_end
+        && fwrite(tags.data(), 1, capacity, out) == capacity;
+    ok &= fclose(out) == 0;
+    return ok;
+}
+
+// Снимок, отображенный в память. Отображение копируется при записи (MAP_PRIVATE):
+// пока таблицу только читают, страницы общие для всех процессов, а add() или clear()
+// меняют копию страницы в этом процессе и не трогают файл.
+class MappedHashSet {
+public:
+    MappedHashSet() = default;
+    MappedHashSet(const MappedHashSet &) = delete;
+    MappedHashSet &operator=(const MappedHashSet &) = delete;
+
+    ~MappedHashSet() {
+        close();
+    }
+
+    // false, если файл не открылся или не похож на снимок; причина в error().
+    bool open(const string &path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return fail(path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HashSetSnapshotHeader)) {
+            ::close(fd);
+            return fail(path + ": file is too small");
+        }
+        _length = st.st_size;
+        void *memory = mmap(nullptr, _length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            return fail(path + ": " + strerror(errno));
+        }
+        _memory = static_cast<char *>(memory);
+        return validate(path);
+    }
+
+    void close() {
+        _set.reset();
+        if (_memory) {
+            munmap(_memory, _length);
+        }
+        _memory = nullptr;
+        _length = 0;
+    }
+
+    bool is_open() const {
+        return _set != nullptr;
+    }
+
+    const string &error() const {
+        return _error;
+    }
+
+    // Таблица живет, пока открыт снимок.
+    FastIntHashSet &set() {
+        return *_set;
+    }
+
+    const FastIntHashSet &set() const {
+        return *_set;
+    }
+
+private:
+    char *_memory = nullptr;
+    size_t _length = 0;
+    unique_ptr<FastIntHashSet> _set;
+    string _error;
+
+    bool fail(const string &message) {
+        close();
+        _error = message;
+        return false;
+    }
+
+    bool validate(const string &path) {
+        HashSetSnapshotHeader header;
+        memcpy(&header, _memory, sizeof(header));
+        if (memcmp(header.magic, HASH_SET_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            return fail(path + ": not a hash set snapshot");
+        }
+        if (header.version != HASH_SET_SNAPSHOT_VERSION) {
+            return fail(path + ": unsupported version " + to_string(header.version));
+        }
+        if (header.hash_function != HASH_SET_GOOD_HASH_FASTRANGE_LINEAR) {
+            return fail(path + ": unsupported hash function " + to_string(header.hash_function));
+        }
+        // get_index считает индекс в int, а пустая таблица не может ничего найти.
+        bool ok = header.capacity > 0 && header.capacity <= INT_MAX && header.size < header.capacity
+            && header.epoch > 0 && header.epoch <= UINT8_MAX
+            && header.slots_offset % INT_SET_FILE_ALIGNMENT == 0 && header.tags_offset % INT_SET_FILE_ALIGNMENT == 0
+            && header.slots_offset <= _length && header.capacity <= (_length - header.slots_offset) / sizeof(int)
+            && header.tags_offset <= _length && header.capacity <= _length - header.tags_offset;
+        if (!ok) {
+            return fail(path + ": snapshot is out of file bounds");
+        }
+        _set.reset(new FastIntHashSet(reinterpret_cast<int *>(_memory + header.slots_offset),
+                                      reinterpret_cast<uint8_t *>(_memory + header.tags_offset),
+                                      header.capacity, header.size, header.epoch));
+        _error.clear();
+        return true;
+    }
+};
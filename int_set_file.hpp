@@ -0,0 +1,351 @@
+#pragma once
+
+// Бинарный формат файла с множеством int и загрузка через mmap без копирования.
+//
+// Раскладка файла (порядок байт - как у машины, которая писала):
+//   [0, 64)                  IntSetFileHeader
+//   [payload_offset, ...)    count значений int32, payload_offset кратен 64
+//   [index_offset, ...)      index_count значений int32, только для отсортированных данных:
+//                            каждый INT_SET_INDEX_STRIDE-й элемент, начиная с нулевого
+//
+// Текстовый файл приходится разбирать целиком, а этот открывается за время mmap и одного
+// последовательного прохода, который сверяет данные с флагом SORTED, min/max и индексом.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "count_intersection.hpp"
+#include "int_text_parser.hpp"
+
+const char INT_SET_FILE_MAGIC[8] = {'V', 'K', 'I', 'N', 'T', 'S', 'E', 'T'};
+const uint32_t INT_SET_FILE_VERSION = 1;
+const uint32_t INT_SET_FILE_SORTED = 1;
+const uint32_t INT_SET_FILE_HAS_INDEX = 2;
+const size_t INT_SET_FILE_ALIGNMENT = 64;
+const size_t INT_SET_INDEX_STRIDE = 256;
+
+struct IntSetFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    int32_t min;
+    int32_t max;
+    uint64_t payload_offset;
+    uint64_t index_offset;
+    uint64_t index_count;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(IntSetFileHeader) == INT_SET_FILE_ALIGNMENT, "header must fill exactly one cache line");
+
+inline size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Пишет values в файл. Индекс строится, только если with_index и значения отсортированы.
+inline bool write_int_set_file(const string &path, IntArrayView values, bool with_index = true) {
+    IntSetFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INT_SET_FILE_MAGIC, sizeof(header.magic));
+    header.version = INT_SET_FILE_VERSION;
+    header.count = values.size();
+
+    bool sorted = is_sorted(begin(values), end(values));
+    if (sorted) {
+        header.flags |= INT_SET_FILE_SORTED;
+    }
+    if (!values.empty()) {
+        auto min_max = minmax_element(begin(values), end(values));
+        header.min = *min_max.first;
+        header.max = *min_max.second;
+    }
+
+    vector<int> index;
+    if (with_index && sorted) {
+        for (size_t i = 0; i < values.size(); i += INT_SET_INDEX_STRIDE) {
+            index.push_back(values[i]);
+        }
+        header.flags |= INT_SET_FILE_HAS_INDEX;
+    }
+
+    header.payload_offset = INT_SET_FILE_ALIGNMENT;
+    size_t payload_end = header.payload_offset + values.size() * sizeof(int);
+    if (!index.empty()) {
+        header.index_offset = align_up(payload_end, INT_SET_FILE_ALIGNMENT);
+        header.index_count = index.size();
+    }
+
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    static const char zeros[INT_SET_FILE_ALIGNMENT] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(values.data(), sizeof(int), values.size(), out) == values.size();
+    if (ok && !index.empty()) {
+        ok = fwrite(zeros, 1, header.index_offset - payload_end, out) == header.index_offset - payload_end
+            && fwrite(index.data(), sizeof(int), index.size(), out) == index.size();
+    }
+    ok &= fclose(out) == 0;
+    return ok;
+}
+
+// Файл, отображенный в память. view() можно передавать в любой алгоритм пересечения,
+// данные не копируются. Объект владеет отображением, поэтому только перемещается.
+class MappedIntSet {
+public:
+    MappedIntSet() = default;
+    MappedIntSet(const MappedIntSet &) = delete;
+    MappedIntSet &operator=(const MappedIntSet &) = delete;
+
+    MappedIntSet(MappedIntSet &&other) {
+        *this = move(other);
+    }
+
+    MappedIntSet &operator=(MappedIntSet &&other) {
+        if (this != &other) {
+            close();
+            _memory = other._memory;
+            _length = other._length;
+            _header = other._header;
+            _error = move(other._error);
+            other._memory = nullptr;
+            other._length = 0;
+            other._header = nullptr;
+        }
+        return *this;
+    }
+
+    ~MappedIntSet() {
+        close();
+    }
+
+    // false, если файл не открылся или не похож на правильный; причина в error().
+    bool open(const string &path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return fail(path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return fail(path + ": " + strerror(errno));
+        }
+        _length = st.st_size;
+        if (_length < sizeof(IntSetFileHeader)) {
+            ::close(fd);
+            return fail(path + ": file is too small");
+        }
+        void *memory = mmap(nullptr, _length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            return fail(path + ": " + strerror(errno));
+        }
+        _memory = memory;
+        _header = static_cast<const IntSetFileHeader *>(_memory);
+        return validate(path);
+    }
+
+    void close() {
+        if (_memory) {
+            munmap(_memory, _length);
+        }
+        _memory = nullptr;
+        _header = nullptr;
+        _length = 0;
+    }
+
+    bool is_open() const {
+        return _header != nullptr;
+    }
+
+    const string &error() const {
+        return _error;
+    }
+
+    IntArrayView view() const {
+        return IntArrayView(payload(), size(), sorted());
+    }
+
+    size_t size() const {
+        return _header->count;
+    }
+
+    bool sorted() const {
+        return _header->flags & INT_SET_FILE_SORTED;
+    }
+
+    int min() const {
+        return _header->min;
+    }
+
+    int max() const {
+        return _header->max;
+    }
+
+    bool has_index() const {
+        return _header->flags & INT_SET_FILE_HAS_INDEX;
+    }
+
+    // Каждый INT_SET_INDEX_STRIDE-й элемент отсортированных данных.
+    IntArrayView index() const {
+        if (!has_index()) {
+            return IntArrayView();
+        }
+        return IntArrayView(at<int>(_header->index_offset), _header->index_count, true);
+    }
+
+    // Поиск в отсортированных данных: сначала по маленькому индексу, который всегда в кэше,
+    // затем внутри одного блока из INT_SET_INDEX_STRIDE элементов. Так на огромном файле
+    // трогаем одну-две страницы вместо log2(n) разных.
+    bool contains(int value) const {
+        IntArrayView values = view();
+        if (values.empty() || value < min() || value > max()) {
+            return false;
+        }
+        if (!sorted()) {
+            return find(begin(values), end(values), value) != end(values);
+        }
+        if (!has_index()) {
+            return binary_search(begin(values), end(values), value);
+        }
+        IntArrayView fences = index();
+        size_t block = upper_bound(begin(fences), end(fences), value) - begin(fences) - 1;
+        size_t first = block * INT_SET_INDEX_STRIDE;
+        size_t last = ::min(first + INT_SET_INDEX_STRIDE, values.size());
+        return binary_search(values.data() + first, values.data() + last, value);
+    }
+
+private:
+    void *_memory = nullptr;
+    size_t _length = 0;
+    const IntSetFileHeader *_header = nullptr;
+    string _error;
+
+    template <class T>
+    const T *at(uint64_t offset) const {
+        return reinterpret_cast<const T *>(static_cast<const char *>(_memory) + offset);
+    }
+
+    const int *payload() const {
+        return at<int>(_header->payload_offset);
+    }
+
+    bool fail(const string &message) {
+        close();
+        _error = message;
+        return false;
+    }
+
+    bool validate(const string &path) {
+        const IntSetFileHeader &header = *_header;
+        if (memcmp(header.magic, INT_SET_FILE_MAGIC, sizeof(header.magic)) != 0) {
+            return fail(path + ": not an int set file");
+        }
+        if (header.version != INT_SET_FILE_VERSION) {
+            return fail(path + ": unsupported version " + to_string(header.version));
+        }
+        // Сравниваем через деление, чтобы большие count из битого файла не переполнили произведение.
+        bool payload_ok = header.payload_offset % INT_SET_FILE_ALIGNMENT == 0
+            && header.payload_offset <= _length
+            && header.count <= (_length - header.payload_offset) / sizeof(int);
+        if (!payload_ok) {
+            return fail(path + ": payload is out of file bounds");
+        }
+        if (has_index()) {
+            bool index_ok = sorted()
+                && header.index_offset % INT_SET_FILE_ALIGNMENT == 0
+                && header.index_offset <= _length
+                && header.index_count <= (_length - header.index_offset) / sizeof(int)
+                && header.index_count == (header.count + INT_SET_INDEX_STRIDE - 1) / INT_SET_INDEX_STRIDE;
+            if (!index_ok) {
+                return fail(path + ": index is out of file bounds");
+            }
+        }
+        return validate_values(path);
+    }
+
+    // Заголовку верим, только сверив его с данными: иначе view() передал бы known_sorted
+    // неотсортированного массива в алгоритмы пересечения, а contains() отсекал бы значения
+    // по неверным min/max, и битый файл молча давал бы неверные ответы.
+    bool validate_values(const string &path) {
+        const IntSetFileHeader &header = *_header;
+        const int *values = payload();
+        bool ordered = true;
+        int low = header.count > 0 ? values[0] : header.min;
+        int high = header.count > 0 ? values[0] : header.max;
+        for (size_t i = 1; i < header.count; i++) {
+            ordered &= values[i - 1] <= values[i];
+            low = ::min(low, values[i]);
+            high = ::max(high, values[i]);
+        }
+        if (sorted() && !ordered) {
+            return fail(path + ": values are not sorted, but the header says they are");
+        }
+        if (low != header.min || high != header.max) {
+            return fail(path + ": min/max in the header do not match the values");
+        }
+        if (has_index()) {
+            const int *fences = at<int>(header.index_offset);
+            for (size_t i = 0; i < header.index_count; i++) {
+                if (fences[i] != values[i * INT_SET_INDEX_STRIDE]) {
+                    return fail(path + ": index does not match the values");
+                }
+            }
+        }
+        _error.clear();
+        return true;
+    }
+};
+
+// Множество из файла любого формата: бинарный отображается в память, текст разбирается в parsed.
+struct LoadedIntSet {
+    MappedIntSet mapped;
+    vector<int> parsed;
+    IntArrayView view;
+    bool binary = false;
+};
+
+// Начинается ли файл с INT_SET_FILE_MAGIC, то есть бинарный ли он, даже если битый.
+inline bool has_int_set_file_magic(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    char magic[sizeof(INT_SET_FILE_MAGIC)];
+    bool ok = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic)
+        && memcmp(magic, INT_SET_FILE_MAGIC, sizeof(magic)) == 0;
+    ::close(fd);
+    return ok;
+}
+
+// Бинарный файл, который не прошел проверку, как текст не разбираем: иначе вместо
+// настоящей причины (версия, обрезанные данные) получили бы бессмысленную ошибку разбора.
+inline bool load_int_set(const string &path, LoadedIntSet &set, string *error = nullptr) {
+    set.binary = set.mapped.open(path);
+    if (set.binary) {
+        set.view = set.mapped.view();
+        return true;
+    }
+    if (has_int_set_file_magic(path)) {
+        if (error) {
+            *error = set.mapped.error();
+        }
+        return false;
+    }
+    set.parsed.clear();
+    if (!parse_int_text_file(path, set.parsed, error)) {
+        return false;
+    }
+    set.view = set.parsed;
+    return true;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// Быстрый разбор текстового файла с числами (по одному на строку или через любые пробелы).
+// strtol/istream тратят время на локаль и проверки на каждый символ; здесь восемь цифр подряд
+// проверяются и переводятся в число сразу, как одно 64-битное слово (SWAR).
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+inline bool is_digit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
+
+inline bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// Все ли 8 байт слова - цифры: старший полубайт каждого байта равен 3 и остается 3
+// после прибавления 6 (т.е. младший не больше 9).
+inline bool swar_all_digits(uint64_t chunk) {
+    return ((chunk & 0xF0F0F0F0F0F0F0F0) | (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+        == 0x3333333333333333;
+}
+
+// Восемь цифр (первая в младшем байте) в число: попарно складываем соседние разряды,
+// потом пары, потом четверки.
+inline uint32_t swar_parse_8_digits(uint64_t chunk) {
+    chunk -= 0x3030303030303030;
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FF;
+    chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFF;
+    chunk = (chunk * 10000 + (chunk >> 32)) & 0xFFFFFFFF;
+    return (uint32_t)chunk;
+}
+
+// Разбирает [p, end) и дописывает числа в values. false, если встретилось не число
+// или число не помещается в int; тогда в *error смещение и причина.
+inline bool parse_int_text(const char *p, const char *end, vector<int> &values, string *error = nullptr) {
+    const char *start = p;
+    auto fail = [&](const char *reason) {
+        if (error) {
+            *error = "offset " + to_string(p - start) + ": " + reason;
+        }
+        return false;
+    };
+
+    while (true) {
+        while (p != end && is_space(*p)) {
+            ++p;
+        }
+        if (p == end) {
+            return true;
+        }
+        bool negative = *p == '-';
+        p += negative;
+        if (p == end || !is_digit(*p)) {
+            return fail("expected a number");
+        }
+
+        // Ведущие нули не значащие: без этого 00000000001 считалось бы слишком длинным числом.
+        while (p != end && *p == '0') {
+            ++p;
+        }
+        const char *digits = p;
+        uint64_t value = 0;
+        // Числа из 8 и больше цифр бывают часто (идентификаторы), а значит, их стоит разбирать сразу словом.
+        if (end - p >= 8) {
+            uint64_t chunk;
+            memcpy(&chunk, p, sizeof(chunk));
+            if (swar_all_digits(chunk)) {
+                value = swar_parse_8_digits(chunk);
+                p += 8;
+            }
+        }
+        while (p != end && is_digit(*p)) {
+            value = value * 10 + (*p - '0');
+            ++p;
+            if (p - digits > 10) {
+                return fail("number is out of int range");
+            }
+        }
+        if (p != end && !is_space(*p)) {
+            return fail("unexpected character");
+        }
+        if (value > (uint64_t)INT32_MAX + negative) {
+            return fail("number is out of int range");
+        }
+        values.push_back(negative ? (int)(0 - value) : (int)value);
+    }
+}
+
+// Файл отображаем в память и разбираем прямо оттуда, без копии в строку.
+inline bool parse_int_text_file(const string &path, vector<int> &values, string *error = nullptr) {
+    auto fail = [&](const string &reason) {
+        if (error) {
+            *error = path + ": " + reason;
+        }
+        return false;
+    };
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return fail(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return fail(strerror(errno));
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    void *memory = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return fail(strerror(errno));
+    }
+    madvise(memory, st.st_size, MADV_SEQUENTIAL);
+    const char *text = static_cast<const char *>(memory);
+    // Примерно по 8 символов на число, чтобы вектор не перевыделялся много раз.
+    values.reserve(values.size() + st.st_size / 8);
+    string reason;
+    bool ok = parse_int_text(text, text + st.st_size, values, &reason);
+    munmap(memory, st.st_size);
+    return ok || fail(reason);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+// Проверка ключей сразу для многих независимых запросов к хеш-таблицам с чередованием
+// (AMAC, asynchronous memory access chaining). Одиночный поиск в большой таблице почти все
+// время ждет промаха кэша. Здесь держим group поисков "в полете": для каждого считаем домашний
+// слот и делаем prefetch, а к слоту возвращаемся, когда остальные group - 1 поисков тоже
+// отправили свои запросы в память. Закончившийся поиск сразу заменяется следующим ключом,
+// ключи берутся по очереди из всех запросов, так что промахи разных запросов перекрываются.
+//
+// Каждый поиск - маленький автомат (запрос, ключ, текущий слот), это то же самое, что дали бы
+// корутины C++20, только без них: проект собирается как C++14.
+//
+// Выигрыш есть только для таблиц, которые не помещаются в кэш: на таблицах поменьше
+// процессор и сам перекрывает независимые поиски подряд идущих ключей, а чередование
+// запросов только вытесняет из кэша таблицу соседнего запроса. Поэтому маленькие таблицы
+// проверяются как обычно, через count_contained.
+
+#include <vector>
+
+#include "count_intersection.hpp"
+
+struct HashProbeQuery {
+    const FastIntHashSet *set;
+    IntArrayView probe;
+};
+
+// Больше поисков в полете не помогает: столько промахов ядро все равно не держит.
+const int MAX_INTERLEAVED_PROBES = 32;
+const int DEFAULT_INTERLEAVED_PROBES = 8;
+// Таблицы меньше этого (слоты и метки) проверяются без чередования.
+const size_t INTERLEAVE_MIN_TABLE_BYTES = 16 << 20;
+
+// counts[i] = queries[i].set->count_contained(queries[i].probe).
+inline vector<int> count_contained_interleaved(const vector<HashProbeQuery> &queries,
+                                               int group = DEFAULT_INTERLEAVED_PROBES,
+                                               size_t min_table_bytes = INTERLEAVE_MIN_TABLE_BYTES) {
+    struct Lookup {
+        size_t query;
+        int element;
+        size_t slot;
+    };
+
+    vector<int> counts(queries.size(), 0);
+    group = max(1, min(group, MAX_INTERLEAVED_PROBES));
+
+    // Запросы, в которых еще есть ключи, и сколько ключей каждого уже взято.
+    vector<size_t> live, taken(queries.size(), 0);
+    for (size_t q = 0; q < queries.size(); q++) {
+        const FastIntHashSet &set = *queries[q].set;
+        if (set.capacity() * (sizeof(int) + 1) < min_table_bytes) {
+            counts[q] = set.count_contained(queries[q].probe);
+        } else if (!queries[q].probe.empty()) {
+            live.push_back(q);
+        }
+    }
+    size_t cursor = 0;
+
+    // Следующий ключ по кругу из всех запросов: считаем слот и просим его у памяти.
+    auto start = [&](Lookup &lookup) {
+        if (live.empty()) {
+            return false;
+        }
+        if (cursor >= live.size()) {
+            cursor = 0;
+        }
+        size_t q = live[cursor];
+        const HashProbeQuery &query = queries[q];
+        lookup.query = q;
+        lookup.element = query.probe[taken[q]++];
+        lookup.slot = FastIntHashSet::home_slot(lookup.element, query.set->capacity());
+        __builtin_prefetch(query.set->tags() + lookup.slot);
+        __builtin_prefetch(query.set->slots() + lookup.slot);
+        if (taken[q] == query.probe.size()) {
+            live[cursor] = live.back();
+            live.pop_back();
+        } else {
+            ++cursor;
+        }
+        return true;
+    };
+
+    Lookup lookups[MAX_INTERLEAVED_PROBES];
+    int active = 0;
+    while (active < group && start(lookups[active])) {
+        ++active;
+    }
+    while (active > 0) {
+        for (int g = 0; g < active; g++) {
+            Lookup &lookup = lookups[g];
+            const FastIntHashSet &set = *queries[lookup.query].set;
+            // Слот уже в кэше. Дальнейшее пробирование обычно остается в той же кэш-линии,
+            // поэтому идем по нему сразу, не откладывая.
+            size_t slot = lookup.slot;
+            while (set.tags()[slot] == set.epoch() && set.slots()[slot] != lookup.element) {
+                if (++slot == set.capacity()) {
+                    slot = 0;
+                }
+            }
+            counts[lookup.query] += set.tags()[slot] == set.epoch();
+            if (!start(lookup)) {
+                // Новых ключей нет: последний поиск встает на место закончившегося.
+                lookups[g--] = lookups[--active];
+            }
+        }
+    }
+    return counts;
+}
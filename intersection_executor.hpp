@@ -0,0 +1,462 @@
+#pragma once
+
+// Пул потоков для пачек запросов count_intersection, стоимость которых отличается
+// на порядки (от 5 на 50 до 10^6 на 10^7). Каждый поток берет задачи из своей очереди
+// с конца, а когда она пуста - крадет из начала чужой очереди. Большой запрос, для которого
+// модель выбрала хеш-таблицу, делится на части: таблица по smaller строится один раз,
+// а куски larger проверяются по ней отдельными задачами, которые разбирают свободные потоки.
+//
+// Кроме пачек, запросы можно отправлять по одному и не ждать: submit() возвращает future,
+// вызывает callback или кладет результат в IntersectionCompletionQueue для цикла событий.
+// Во всех случаях массивы запроса должны жить, пока он не посчитан. Исключение при подсчете
+// (например, bad_alloc при построении таблицы) не роняет пул, а доходит до того, кто ждет ответа.
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "count_intersection.hpp"
+
+// Завершение запроса: error пуст, если count посчитан, иначе count равен 0.
+typedef function<void(int count, exception_ptr error)> IntersectionCallback;
+
+struct IntersectionExecutorOptions {
+    int threads = 0;                   // 0 - по числу ядер
+    size_t split_elements = 1 << 18;   // запросы с larger не меньше этого делятся на части
+    size_t probe_chunk = 1 << 16;      // элементов larger в одной части
+};
+
+// Очередь готовых результатов для серверов с циклом событий (epoll, poll). fd() читаем,
+// пока в очереди что-то есть, так что его можно добавить в цикл рядом с сокетами,
+// а разбирать результаты в том же потоке через pop_all().
+class IntersectionCompletionQueue {
+public:
+    struct Completion {
+        uint64_t tag;  // то, что передали в submit, например номер запроса клиента
+        int count;
+        exception_ptr error;  // не пуст, если подсчет бросил исключение
+    };
+
+    IntersectionCompletionQueue() : _fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+    IntersectionCompletionQueue(const IntersectionCompletionQueue &) = delete;
+    IntersectionCompletionQueue &operator=(const IntersectionCompletionQueue &) = delete;
+
+    ~IntersectionCompletionQueue() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    // -1, если eventfd не создался; очередь при этом работает, только без уведомлений.
+    int fd() const {
+        return _fd;
+    }
+
+    void push(const Completion &completion) {
+        lock_guard<mutex> guard(_lock);
+        _completions.push_back(completion);
+        _ready.notify_one();
+        if (_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t written = ::write(_fd, &one, sizeof(one));
+            (void)written;  // переполнить счетчик eventfd нельзя, а других ошибок не бывает
+        }
+    }
+
+    // Забирает все готовые результаты, не блокируясь. Возвращает их число.
+    size_t pop_all(vector<Completion> &out) {
+        lock_guard<mutex> guard(_lock);
+        size_t count = _completions.size();
+        out.insert(end(out), begin(_completions), end(_completions));
+        _completions.clear();
+        drain_fd();
+        return count;
+    }
+
+    // Ждет хотя бы один результат. Для потоков без цикла событий.
+    Completion pop() {
+        unique_lock<mutex> guard(_lock);
+        _ready.wait(guard, [&] { return !_completions.empty(); });
+        Completion completion = _completions.front();
+        _completions.pop_front();
+        if (_completions.empty()) {
+            drain_fd();
+        }
+        return completion;
+    }
+
+private:
+    int _fd;
+    mutex _lock;
+    condition_variable _ready;
+    deque<Completion> _completions;
+
+    // Под _lock: сбрасывает счетчик eventfd, когда очередь опустела.
+    void drain_fd() {
+        if (_fd >= 0) {
+            uint64_t value;
+            ssize_t got = ::read(_fd, &value, sizeof(value));
+            (void)got;  // EAGAIN - счетчик уже нулевой
+        }
+    }
+};
+
+class IntersectionExecutor {
+public:
+    explicit IntersectionExecutor(const IntersectionExecutorOptions &options = IntersectionExecutorOptions())
+        : _options(options) {
+        int threads = options.threads > 0 ? options.threads : max(1, (int)thread::hardware_concurrency());
+        _options.probe_chunk = max(_options.probe_chunk, (size_t)1);
+        _workers.reserve(threads);
+        for (int t = 0; t < threads; t++) {
+            _workers.emplace_back(new Worker());
+        }
+        for (int t = 0; t < threads; t++) {
+            _workers[t]->handle = thread([this, t] { work(t); });
+        }
+    }
+
+    IntersectionExecutor(const IntersectionExecutor &) = delete;
+    IntersectionExecutor &operator=(const IntersectionExecutor &) = delete;
+
+    // Дожидается всех уже отправленных запросов.
+    ~IntersectionExecutor() {
+        {
+            lock_guard<mutex> guard(_idle_lock);
+            _stopping = true;
+        }
+        _idle.notify_all();
+        for (auto &worker : _workers) {
+            worker->handle.join();
+        }
+    }
+
+    int threads() const {
+        return (int)_workers.size();
+    }
+
+    // results[i] = count_intersection(queries[i].first, queries[i].second). Ждет, пока посчитаются
+    // все запросы. Пачки и отдельные запросы из разных потоков выполняются вперемешку.
+    // Если какой-то запрос бросил исключение, оно пробрасывается, когда досчитаются остальные.
+    vector<int> count_batch(const vector<pair<IntArrayView, IntArrayView>> &queries) {
+        vector<int> results(queries.size(), 0);
+        mutex lock;
+        condition_variable done;
+        size_t remaining = queries.size();
+        exception_ptr failure;
+        for (size_t i = 0; i < queries.size(); i++) {
+            submit(queries[i].first, queries[i].second, IntersectionCallback([&, i](int count, exception_ptr error) {
+                results[i] = count;
+                // Уменьшаем под замком: иначе count_batch может увидеть ноль и уничтожить
+                // lock и done раньше, чем мы позовем notify.
+                lock_guard<mutex> guard(lock);
+                if (error && !failure) {
+                    failure = error;
+                }
+                if (--remaining == 0) {
+                    done.notify_all();
+                }
+            }));
+        }
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&] { return remaining == 0; });
+        if (failure) {
+            rethrow_exception(failure);
+        }
+        return results;
+    }
+
+    // Запускает запрос и сразу возвращается. callback вызывается в потоке пула.
+    void submit(IntArrayView a, IntArrayView b, IntersectionCallback callback) {
+        unique_ptr<QueryState> query(new QueryState(a, b, move(callback)));
+        // Раскладка по кругу, дальше неравномерность выравнивает кража.
+        ++_in_flight;
+        try {
+            push(_next_worker++ % _workers.size(), Task{query.get(), 0, 0, false});
+        } catch (...) {
+            // Запрос не попал в очередь: исключение уходит вызывающему, пул его не ждет.
+            --_in_flight;
+            lock_guard<mutex> guard(_idle_lock);
+            _idle.notify_all();
+            throw;
+        }
+        query.release();
+    }
+
+    // callback(count); если подсчет бросил исключение, callback(-1), а причину можно получить
+    // через вариант с IntersectionCallback.
+    void submit(IntArrayView a, IntArrayView b, function<void(int)> callback) {
+        submit(a, b, IntersectionCallback([callback](int count, exception_ptr error) {
+            callback(error ? -1 : count);
+        }));
+    }
+
+    // Исключение при подсчете future отдаст из get().
+    future<int> submit(IntArrayView a, IntArrayView b) {
+        shared_ptr<promise<int>> result = make_shared<promise<int>>();
+        future<int> answer = result->get_future();
+        submit(a, b, IntersectionCallback([result](int count, exception_ptr error) {
+            if (error) {
+                result->set_exception(error);
+            } else {
+                result->set_value(count);
+            }
+        }));
+        return answer;
+    }
+
+    // Результат придет в queue с меткой tag, исключение - в Completion::error.
+    void submit(IntArrayView a, IntArrayView b, IntersectionCompletionQueue &queue, uint64_t tag) {
+        submit(a, b, IntersectionCallback([&queue, tag](int count, exception_ptr error) {
+            queue.push(IntersectionCompletionQueue::Completion{tag, count, error});
+        }));
+    }
+
+    // Сколько задач выполнено не тем потоком, которому достались. Для тестов и отладки.
+    size_t stolen_tasks() const {
+        return _stolen;
+    }
+
+    // Сколько запросов было поделено на части.
+    size_t split_queries() const {
+        return _split;
+    }
+
+    // Сколько раз callback бросил исключение. Отдать его некому, поэтому пул его
+    // перехватывает и только считает, чтобы не уронить процесс.
+    size_t failed_callbacks() const {
+        return _failed_callbacks;
+    }
+
+private:
+    // Запрос целиком или проверка куска [begin, end) larger по общей таблице запроса.
+    struct QueryState;
+
+    struct Task {
+        QueryState *query;
+        size_t begin;
+        size_t end;
+        bool probe;
+    };
+
+    struct Worker {
+        mutex lock;
+        deque<Task> tasks;
+        thread handle;
+    };
+
+    // Живет, пока запрос не посчитан, удаляется в finish().
+    struct QueryState {
+        QueryState(IntArrayView a, IntArrayView b, IntersectionCallback callback)
+            : smaller(a), larger(b), done(move(callback)) {
+            if (smaller.size() > larger.size()) {
+                swap(smaller, larger);
+            }
+        }
+
+        IntArrayView smaller;
+        IntArrayView larger;
+        atomic<int> count{0};
+        atomic<size_t> parts{0};  // сколько кусков еще не проверено
+        unique_ptr<FastIntHashSet> index;
+        IntersectionCallback done;
+        atomic<bool> failed{false};
+        exception_ptr error;  // первое исключение; читается в finish(), когда все куски отработали
+
+        void fail(exception_ptr e) {
+            if (!failed.exchange(true)) {
+                error = e;
+            }
+        }
+    };
+
+    IntersectionExecutorOptions _options;
+    vector<unique_ptr<Worker>> _workers;
+    atomic<size_t> _next_worker{0};
+
+    // Задачи во всех очередях: по нему спящие потоки понимают, что пора проснуться.
+    atomic<size_t> _queued{0};
+    mutex _idle_lock;
+    condition_variable _idle;
+    bool _stopping = false;
+    atomic<size_t> _in_flight{0};  // отправленные, но еще не посчитанные запросы
+
+    atomic<size_t> _stolen{0};
+    atomic<size_t> _split{0};
+    atomic<size_t> _failed_callbacks{0};
+
+    void push(size_t worker, const Task &task) {
+        {
+            lock_guard<mutex> guard(_workers[worker]->lock);
+            _workers[worker]->tasks.push_back(task);
+        }
+        ++_queued;
+        // Под замком, иначе поток может проверить _queued и уснуть уже после notify.
+        lock_guard<mutex> guard(_idle_lock);
+        _idle.notify_one();
+    }
+
+    // Своя очередь - с конца: там самые свежие и еще горячие в кэше куски.
+    bool pop(size_t self, Task &task) {
+        Worker &worker = *_workers[self];
+        lock_guard<mutex> guard(worker.lock);
+        if (worker.tasks.empty()) {
+            return false;
+        }
+        task = worker.tasks.back();
+        worker.tasks.pop_back();
+        --_queued;
+        return true;
+    }
+
+    // Чужие - с начала: там задачи, до которых хозяин доберется последним.
+    bool steal(size_t self, Task &task) {
+        for (size_t k = 1; k < _workers.size(); k++) {
+            Worker &victim = *_workers[(self + k) % _workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                --_queued;
+                ++_stolen;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        while (true) {
+            Task task;
+            if (pop(self, task) || steal(self, task)) {
+                run(self, task);
+                continue;
+            }
+            unique_lock<mutex> guard(_idle_lock);
+            // Очереди пусты, но запрос в другом потоке еще может поделиться на куски.
+            auto finished = [&] { return _stopping && _in_flight == 0; };
+            _idle.wait(guard, [&] { return _queued > 0 || finished(); });
+            if (_queued == 0 && finished()) {
+                return;
+            }
+        }
+    }
+
+    // Исключения задачи попадают в запрос: поток пула не должен падать, а запрос -
+    // теряться, иначе ждущий future никогда не получит ответа, а деструктор повиснет на _in_flight.
+    void run(size_t self, const Task &task) {
+        QueryState &query = *task.query;
+        if (task.probe) {
+            try {
+                query.count += query.index->count_contained(query.larger.subview(task.begin, task.end - task.begin));
+            } catch (...) {
+                query.fail(current_exception());
+            }
+            complete_parts(task.query, 1);
+            return;
+        }
+        try {
+            if (start(self, task)) {
+                return;
+            }
+        } catch (...) {
+            query.fail(current_exception());
+        }
+        finish(task.query);
+    }
+
+    // Считает запрос целиком (false) или строит таблицу и раскладывает куски larger по задачам (true).
+    bool start(size_t self, const Task &task) {
+        QueryState &query = *task.query;
+        if (query.smaller.empty()) {
+            return false;
+        }
+        if (query.larger.size() < _options.split_elements) {
+            query.count = count_intersection(query.smaller, query.larger);
+            return false;
+        }
+        IntersectionShape shape = describe_intersection(query.smaller, query.larger);
+        IntersectionStrategy strategy = intersection_cost_model().choose(shape);
+        if (strategy != IntersectionStrategy::by_hash) {
+            query.count = count_intersection_with(strategy, shape, query.smaller, query.larger);
+            return false;
+        }
+
+        // Таблицу строит этот поток, куски ложатся в его очередь и разбираются кражей.
+        query.index.reset(new FastIntHashSet(2 * query.smaller.size()));
+        for (auto e : query.smaller) {
+            query.index->add(e);
+        }
+        size_t chunk = _options.probe_chunk;
+        size_t parts = (query.larger.size() + chunk - 1) / chunk;
+        // Лишняя часть не дает запросу завершиться, пока куски еще раскладываются.
+        query.parts = parts + 1;
+        ++_split;
+        size_t pushed = 0;
+        try {
+            for (size_t begin = 0; begin < query.larger.size(); begin += chunk) {
+                push(self, Task{task.query, begin, min(begin + chunk, query.larger.size()), true});
+                ++pushed;
+            }
+        } catch (...) {
+            query.fail(current_exception());
+        }
+        complete_parts(task.query, parts - pushed + 1);
+        return true;
+    }
+
+    void complete_parts(QueryState *query, size_t parts) {
+        if ((query->parts -= parts) == 0) {
+            finish(query);
+        }
+    }
+
+    void finish(QueryState *query) {
+        IntersectionCallback done = move(query->done);
+        exception_ptr error = query->error;
+        int count = error ? 0 : (int)query->count;
+        delete query;
+        try {
+            done(count, error);
+        } catch (...) {
+            ++_failed_callbacks;
+        }
+        if (--_in_flight == 0) {
+            lock_guard<mutex> guard(_idle_lock);
+            _idle.notify_all();
+        }
+    }
+};
+
+// Общий пул на все приложение, создается при первом обращении.
+inline IntersectionExecutor &default_intersection_executor() {
+    static IntersectionExecutor executor;
+    return executor;
+}
+
+inline future<int> submit_intersection(IntArrayView a, IntArrayView b) {
+    return default_intersection_executor().submit(a, b);
+}
+
+inline void submit_intersection(IntArrayView a, IntArrayView b, function<void(int)> callback) {
+    default_intersection_executor().submit(a, b, move(callback));
+}
+
+inline void submit_intersection(IntArrayView a, IntArrayView b, IntersectionCallback callback) {
+    default_intersection_executor().submit(a, b, move(callback));
+}
+
+inline void submit_intersection(IntArrayView a, IntArrayView b, IntersectionCompletionQueue &queue, uint64_t tag) {
+    default_intersection_executor().submit(a, b, queue, tag);
+}
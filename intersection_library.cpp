@@ -0,0 +1,21 @@
+// Единица трансляции библиотеки (см. intersection_library.hpp): здесь из заголовка
+// инстанцируются все ядра, до которых доходят точки входа.
+
+#include "intersection_library.hpp"
+
+namespace vk_db {
+
+int count_intersection(IntArrayView first_array, IntArrayView second_array) {
+    return ::count_intersection(first_array, second_array);
+}
+
+int count_intersection_with(IntersectionStrategy strategy, const IntersectionShape &shape,
+                            IntArrayView smaller, IntArrayView larger) {
+    return ::count_intersection_with(strategy, shape, smaller, larger);
+}
+
+IntersectionShape describe_intersection(IntArrayView smaller, IntArrayView larger) {
+    return ::describe_intersection(smaller, larger);
+}
+
+}
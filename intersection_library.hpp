@@ -0,0 +1,22 @@
+#pragma once
+
+// Основные точки входа, собранные один раз в библиотеку out/libvk_db_intersection.a
+// (intersection_library.cpp). Код тот же, что и в count_intersection.hpp, но компилируется
+// в отдельной единице трансляции, поэтому ее можно собрать с профилем или LTO (make pgo,
+// make lto), а программы просто линкуются с готовыми ядрами. Утилита и бенчмарк считают
+// через эти функции, так что профиль, снятый на бенчмарке, относится ровно к ним.
+
+#include "count_intersection.hpp"
+
+namespace vk_db {
+
+// То же, что ::count_intersection.
+int count_intersection(IntArrayView first_array, IntArrayView second_array);
+
+// То же, что ::count_intersection_with. Считаем что 0 < smaller.size() <= larger.size().
+int count_intersection_with(IntersectionStrategy strategy, const IntersectionShape &shape,
+                            IntArrayView smaller, IntArrayView larger);
+
+IntersectionShape describe_intersection(IntArrayView smaller, IntArrayView larger);
+
+}
@@ -0,0 +1,66 @@
+// Сервер пересечений (см. intersection_server.hpp).
+//
+// Запуск: ./out/intersection_server SOCKET NAME=PATH [NAME=PATH ...]
+//
+// Каждый файл (бинарный или текстовый, как у count_intersection) загружается в память
+// под именем NAME, для него строится индекс. Сервер работает до SIGINT или SIGTERM.
+
+#include <signal.h>
+
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "int_set_file.hpp"
+#include "intersection_server.hpp"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s SOCKET NAME=PATH [NAME=PATH ...]\n", argv[0]);
+        return 1;
+    }
+
+    // Сигналы ловит отдельный поток через sigwait, обработчик сигнала не может вызвать stop().
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    IntersectionServer server;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == string::npos || eq == 0) {
+            fprintf(stderr, "expected NAME=PATH, got %s\n", arg.c_str());
+            return 1;
+        }
+        string name = arg.substr(0, eq);
+        LoadedIntSet loaded;
+        string error;
+        if (!load_int_set(arg.substr(eq + 1), loaded, &error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        server.add_set(name, vector<int>(begin(loaded.view), end(loaded.view)));
+        fprintf(stderr, "%s: %zu values, %s index\n", name.c_str(), loaded.view.size(),
+                server.find_set(name)->has_bitmap() ? "bitmap" : "hash");
+    }
+
+    string error;
+    if (!server.listen(argv[1], &error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    thread waiter([&] {
+        int signal_number;
+        sigwait(&signals, &signal_number);
+        server.stop();
+    });
+    fprintf(stderr, "listening on %s\n", argv[1]);
+    server.serve();
+    // serve() закончился только по stop(), то есть waiter уже завершается.
+    waiter.join();
+    return 0;
+}
@@ -0,0 +1,492 @@
+#pragma once
+
+// Сервер, который держит именованные множества в памяти с готовыми индексами и отвечает
+// на запросы пересечения через Unix domain socket. Клиентам не нужно каждый раз пересылать
+// и заново хешировать одни и те же большие множества.
+//
+// Протокол (порядок байт - как у машины, сокет все равно локальный):
+//   запрос: uint32 длина остального запроса, uint8 тип, затем
+//     INTERSECT_SETS:  uint16 длина имени, имя, uint16 длина имени, имя
+//     INTERSECT_ARRAY: uint16 длина имени, имя, int32 значения до конца запроса
+//   ответ:  int32 - размер пересечения или отрицательный код ошибки.
+// Ответы идут в порядке запросов, поэтому клиент может отправить сразу пачку запросов,
+// не дожидаясь ответов. Сервер разбирает все целиком пришедшие запросы и отвечает на них
+// одной записью в сокет.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "count_intersection.hpp"
+#include "perfect_hash_set.hpp"
+
+enum IntersectionRequestType : uint8_t {
+    INTERSECT_SETS = 1,
+    INTERSECT_ARRAY = 2,
+};
+
+const int INTERSECTION_UNKNOWN_SET = -1;
+const int INTERSECTION_BAD_REQUEST = -2;
+const int INTERSECTION_IO_ERROR = -3; // только на стороне клиента
+
+// Запрос длиннее считаем мусором и закрываем соединение.
+const size_t MAX_INTERSECTION_REQUEST_BYTES = 256 << 20;
+
+// Множество с индексом: битовая маска, если значения лежат плотно, иначе PerfectHashSet
+// (или FastIntHashSet, если PerfectHashSet не построился).
+// После создания не меняется, поэтому его можно читать из любого числа потоков.
+class ResidentIntSet {
+public:
+    // Маска выбирается, если занимает не больше 4 байт на элемент: это меньше таблицы и быстрее.
+    static const size_t BITMAP_BYTES_PER_ELEMENT = 4;
+
+    explicit ResidentIntSet(vector<int> values) : _values(move(values)) {
+        if (_values.empty()) {
+            return;
+        }
+        auto min_max = minmax_element(begin(_values), end(_values));
+        _low = *min_max.first;
+        _span = (uint32_t)*min_max.second - _low;
+        if ((uint64_t)_span / 8 <= BITMAP_BYTES_PER_ELEMENT * _values.size()) {
+            _bits.assign(_span / 64 + 1, 0);
+            for (auto e : _values) {
+                uint32_t offset = (uint32_t)e - _low;
+                _bits[offset >> 6] |= uint64_t(1) << (offset & 63);
+            }
+        } else {
+            _hash.reset(new PerfectHashSet(_values));
+            if (_hash->built()) {
+                // Ключи хранит сам индекс, вторая копия значений не нужна.
+                vector<int>().swap(_values);
+            } else {
+                // Совершенная хеш-функция не нашлась: обычная таблица больше, но отвечает верно.
+                _hash.reset();
+                _fallback.reset(new FastIntHashSet(2 * _values.size()));
+                for (auto e : _values) {
+                    _fallback->add(e);
+                }
+            }
+        }
+    }
+
+    IntArrayView values() const {
+        if (_hash) {
+            return _hash->keys();
+        }
+        return _values;
+    }
+
+    bool has_bitmap() const {
+        return !_bits.empty();
+    }
+
+    bool contains(int element) const {
+        if (_hash) {
+            return _hash->contains(element);
+        }
+        if (_fallback) {
+            return _fallback->contains(element);
+        }
+        if (_values.empty()) {
+            return false;
+        }
+        uint32_t offset = (uint32_t)element - _low;
+        return offset <= _span && ((_bits[offset >> 6] >> (offset & 63)) & 1);
+    }
+
+    // Сколько элементов probe есть в множестве.
+    int count_in(IntArrayView probe) const {
+        if (_fallback) {
+            return _fallback->count_contained(probe);
+        }
+        int ans = 0;
+        for (auto e : probe) {
+            ans += contains(e);
+        }
+        return ans;
+    }
+
+private:
+    vector<int> _values;
+    vector<uint64_t> _bits;
+    uint32_t _low = 0;
+    uint32_t _span = 0;
+    unique_ptr<PerfectHashSet> _hash;
+    unique_ptr<FastIntHashSet> _fallback;  // если PerfectHashSet не построился
+};
+
+inline bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        // MSG_NOSIGNAL: ушедший клиент не должен убивать процесс сигналом SIGPIPE.
+        ssize_t done = send(fd, data, size, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        data += done;
+        size -= done;
+    }
+    return true;
+}
+
+template <class T>
+void append_raw(vector<char> &buffer, const T &value) {
+    const char *p = reinterpret_cast<const char *>(&value);
+    buffer.insert(end(buffer), p, p + sizeof(T));
+}
+
+inline bool make_unix_address(const string &path, sockaddr_un &address, string *error) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        if (error) {
+            *error = path + ": socket path is too long";
+        }
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+class IntersectionServer {
+public:
+    IntersectionServer() = default;
+    IntersectionServer(const IntersectionServer &) = delete;
+    IntersectionServer &operator=(const IntersectionServer &) = delete;
+
+    ~IntersectionServer() {
+        stop();
+        close_listener();
+    }
+
+    // Множества добавляются до serve(); после запуска набор не меняется.
+    void add_set(const string &name, vector<int> values) {
+        _sets[name].reset(new ResidentIntSet(move(values)));
+    }
+
+    const ResidentIntSet *find_set(const string &name) const {
+        auto it = _sets.find(name);
+        return it == _sets.end() ? nullptr : it->second.get();
+    }
+
+    int intersect(const string &name_a, const string &name_b) const {
+        const ResidentIntSet *a = find_set(name_a), *b = find_set(name_b);
+        if (!a || !b) {
+            return INTERSECTION_UNKNOWN_SET;
+        }
+        if (a->values().size() > b->values().size()) {
+            swap(a, b);
+        }
+        return b->count_in(a->values());
+    }
+
+    int intersect(const string &name, IntArrayView values) const {
+        const ResidentIntSet *set = find_set(name);
+        return set ? set->count_in(values) : INTERSECTION_UNKNOWN_SET;
+    }
+
+    // Старый файл сокета удаляется: он остается после аварийного завершения.
+    bool listen(const string &path, string *error = nullptr) {
+        sockaddr_un address;
+        if (!make_unix_address(path, address, error)) {
+            return false;
+        }
+        _listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (_listen_fd < 0 || ::bind(_listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+            || ::listen(_listen_fd, SOMAXCONN) != 0) {
+            if (error) {
+                *error = path + ": " + strerror(errno);
+            }
+            close_listener();
+            return false;
+        }
+        _path = path;
+        return true;
+    }
+
+    // Принимает соединения, пока не вызван stop(). Каждое соединение обслуживает свой поток.
+    // Потоки закрытых соединений собираются при следующем accept, так что у долго работающего
+    // сервера с переподключающимися клиентами они не копятся.
+    void serve() {
+        while (!_stopped) {
+            int fd = accept(_listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR && !_stopped) {
+                    continue;
+                }
+                break;
+            }
+            lock_guard<mutex> guard(_lock);
+            if (_stopped) {
+                close(fd);
+                break;
+            }
+            reap_finished_threads();
+            _connections.push_back(fd);
+            _threads.emplace_back([this, fd] { serve_connection(fd); });
+        }
+        for (auto &t : _threads) {
+            t.join();
+        }
+        _threads.clear();
+        _finished.clear();
+    }
+
+    // Можно вызывать из любого потока: прерывает accept и все соединения.
+    void stop() {
+        lock_guard<mutex> guard(_lock);
+        _stopped = true;
+        if (_listen_fd >= 0) {
+            shutdown(_listen_fd, SHUT_RDWR);
+        }
+        for (int fd : _connections) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    // Открытые соединения и еще не собранные потоки соединений. Для тестов и отладки.
+    size_t connections() {
+        lock_guard<mutex> guard(_lock);
+        return _connections.size();
+    }
+
+    size_t connection_threads() {
+        lock_guard<mutex> guard(_lock);
+        return _threads.size();
+    }
+
+    // Отвечает на все целые запросы из [data, data + size), ответы дописывает в responses.
+    // Возвращает число разобранных байт или SIZE_MAX, если поток запросов испорчен.
+    size_t handle_requests(const char *data, size_t size, vector<char> &responses) const {
+        size_t used = 0;
+        while (size - used >= sizeof(uint32_t)) {
+            uint32_t length;
+            memcpy(&length, data + used, sizeof(length));
+            if (length > MAX_INTERSECTION_REQUEST_BYTES) {
+                return SIZE_MAX;
+            }
+            if (size - used - sizeof(length) < length) {
+                break;
+            }
+            append_raw(responses, handle_request(data + used + sizeof(length), length));
+            used += sizeof(length) + length;
+        }
+        return used;
+    }
+
+private:
+    unordered_map<string, unique_ptr<ResidentIntSet>> _sets;
+    int _listen_fd = -1;
+    string _path;
+    atomic<bool> _stopped{false};
+    mutex _lock;
+    vector<int> _connections;
+    vector<thread> _threads;
+    vector<thread::id> _finished;  // потоки, которые уже вышли из serve_connection
+
+    // Под _lock. Поток из _finished уже отпустил замок и сейчас завершается, join не ждет долго.
+    void reap_finished_threads() {
+        for (auto id : _finished) {
+            for (size_t i = 0; i < _threads.size(); i++) {
+                if (_threads[i].get_id() == id) {
+                    _threads[i].join();
+                    _threads[i] = move(_threads.back());
+                    _threads.pop_back();
+                    break;
+                }
+            }
+        }
+        _finished.clear();
+    }
+
+    void close_listener() {
+        if (_listen_fd >= 0) {
+            close(_listen_fd);
+            _listen_fd = -1;
+        }
+        if (!_path.empty()) {
+            unlink(_path.c_str());
+            _path.clear();
+        }
+    }
+
+    static bool read_name(const char *&p, const char *end, string &name) {
+        uint16_t length;
+        if (end - p < (ptrdiff_t)sizeof(length)) {
+            return false;
+        }
+        memcpy(&length, p, sizeof(length));
+        p += sizeof(length);
+        if (end - p < length) {
+            return false;
+        }
+        name.assign(p, length);
+        p += length;
+        return true;
+    }
+
+    int handle_request(const char *p, size_t length) const {
+        const char *end = p + length;
+        if (length == 0) {
+            return INTERSECTION_BAD_REQUEST;
+        }
+        uint8_t type = *p++;
+        string name_a, name_b;
+        if (!read_name(p, end, name_a)) {
+            return INTERSECTION_BAD_REQUEST;
+        }
+        if (type == INTERSECT_SETS) {
+            if (!read_name(p, end, name_b) || p != end) {
+                return INTERSECTION_BAD_REQUEST;
+            }
+            return intersect(name_a, name_b);
+        }
+        if (type == INTERSECT_ARRAY && (end - p) % sizeof(int) == 0) {
+            // Данные в буфере соединения не обязаны быть выровнены, поэтому копируем.
+            vector<int> values((end - p) / sizeof(int));
+            memcpy(values.data(), p, end - p);
+            return intersect(name_a, values);
+        }
+        return INTERSECTION_BAD_REQUEST;
+    }
+
+    void serve_connection(int fd) {
+        const size_t READ_BYTES = 64 << 10;
+        vector<char> requests, responses;
+        size_t filled = 0;
+        while (true) {
+            requests.resize(filled + READ_BYTES);
+            ssize_t got = read(fd, requests.data() + filled, READ_BYTES);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            filled += got;
+            size_t used = handle_requests(requests.data(), filled, responses);
+            if (used == SIZE_MAX) {
+                break;
+            }
+            requests.erase(begin(requests), begin(requests) + used);
+            filled -= used;
+            if (!responses.empty() && !send_all(fd, responses.data(), responses.size())) {
+                break;
+            }
+            responses.clear();
+        }
+
+        lock_guard<mutex> guard(_lock);
+        _connections.erase(find(begin(_connections), end(_connections), fd));
+        close(fd);
+        _finished.push_back(this_thread::get_id());
+    }
+};
+
+// Клиент: запросы копятся в буфере и уходят одной записью в flush().
+class IntersectionClient {
+public:
+    IntersectionClient() = default;
+    IntersectionClient(const IntersectionClient &) = delete;
+    IntersectionClient &operator=(const IntersectionClient &) = delete;
+
+    ~IntersectionClient() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool connect(const string &path, string *error = nullptr) {
+        sockaddr_un address;
+        if (!make_unix_address(path, address, error)) {
+            return false;
+        }
+        _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (_fd < 0 || ::connect(_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            if (error) {
+                *error = path + ": " + strerror(errno);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Имена короче 64 КБ.
+    void queue_intersect(const string &name_a, const string &name_b) {
+        uint32_t length = 1 + 2 * sizeof(uint16_t) + name_a.size() + name_b.size();
+        append_raw(_requests, length);
+        append_raw(_requests, (uint8_t)INTERSECT_SETS);
+        append_name(name_a);
+        append_name(name_b);
+        ++_pending;
+    }
+
+    void queue_intersect(const string &name, IntArrayView values) {
+        uint32_t length = 1 + sizeof(uint16_t) + name.size() + values.size() * sizeof(int);
+        append_raw(_requests, length);
+        append_raw(_requests, (uint8_t)INTERSECT_ARRAY);
+        append_name(name);
+        const char *p = reinterpret_cast<const char *>(values.data());
+        _requests.insert(end(_requests), p, p + values.size() * sizeof(int));
+        ++_pending;
+    }
+
+    // Отправляет накопленные запросы и ждет ответы на все; results - в порядке запросов.
+    bool flush(vector<int> &results) {
+        results.assign(_pending, INTERSECTION_IO_ERROR);
+        bool ok = send_all(_fd, _requests.data(), _requests.size());
+        _requests.clear();
+        size_t need = _pending * sizeof(int), done = 0;
+        _pending = 0;
+        while (ok && done < need) {
+            ssize_t got = read(_fd, reinterpret_cast<char *>(results.data()) + done, need - done);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = got > 0;
+            done += ok ? got : 0;
+        }
+        // Недочитанные ответы не должны выглядеть как результаты.
+        for (size_t i = done / sizeof(int); i < results.size(); i++) {
+            results[i] = INTERSECTION_IO_ERROR;
+        }
+        return ok;
+    }
+
+    int intersect(const string &name_a, const string &name_b) {
+        vector<int> results;
+        queue_intersect(name_a, name_b);
+        flush(results);
+        return results[0];
+    }
+
+    int intersect(const string &name, IntArrayView values) {
+        vector<int> results;
+        queue_intersect(name, values);
+        flush(results);
+        return results[0];
+    }
+
+private:
+    int _fd = -1;
+    vector<char> _requests;
+    size_t _pending = 0;
+
+    void append_name(const string &name) {
+        append_raw(_requests, (uint16_t)name.size());
+        _requests.insert(end(_requests), begin(name), end(name));
+    }
+};
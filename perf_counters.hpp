@@ -0,0 +1,248 @@
+#pragma once
+
+// Аппаратные счетчики через perf_event_open. Нужны, чтобы объяснить, почему
+// на данном размере выигрывает тот или иной алгоритм. Работают только на Linux,
+// и только если ядро дает доступ к PMU (в виртуалках его часто нет) - иначе
+// available() возвращает false и все значения нулевые.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_EVENTS_COUNT
+};
+
+inline const char *perf_event_name(int event) {
+    static const char *const names[PERF_EVENTS_COUNT] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"
+    };
+    return names[event];
+}
+
+struct PerfCounts {
+    uint64_t values[PERF_EVENTS_COUNT] = {};
+    bool valid[PERF_EVENTS_COUNT] = {}; // счетчик открылся и значение настоящее
+
+    PerfCounts &operator+=(const PerfCounts &other) {
+        for (int i = 0; i < PERF_EVENTS_COUNT; i++) {
+            values[i] += other.values[i];
+            valid[i] |= other.valid[i];
+        }
+        return *this;
+    }
+};
+
+// Счетчики текущего потока: все включаются и читаются вместе.
+// Сначала они открываются одной группой, чтобы значения относились к одному и тому же
+// времени. Если PMU не вмещает их разом (например, один регистр занят NMI watchdog'ом),
+// такая группа ни разу не попадает на PMU, поэтому конструктор пробует ее на коротком цикле
+// и при неудаче делит счетчики на две группы (процессор и ветвления, кэш и TLB), а в крайнем
+// случае открывает каждый отдельно. Ядро чередует группы, а stop() масштабирует значения
+// каждой по доле времени, которое она считала.
+// Не копируется, так как владеет файловыми дескрипторами.
+class PerfCounterGroup {
+public:
+    PerfCounterGroup() {
+#ifdef __linux__
+        // Номер группы для каждого события, в порядке PerfEvent.
+        static const int layouts[][PERF_EVENTS_COUNT] = {
+            {0, 0, 0, 0, 0, 0},
+            {0, 0, 1, 1, 0, 1},
+            {0, 1, 2, 3, 4, 5},
+        };
+        for (auto &layout : layouts) {
+            open(layout);
+            if (!available() || scheduled()) {
+                break;
+            }
+        }
+#endif
+    }
+
+    PerfCounterGroup(const PerfCounterGroup &) = delete;
+    PerfCounterGroup &operator=(const PerfCounterGroup &) = delete;
+
+    ~PerfCounterGroup() {
+#ifdef __linux__
+        close_all();
+#endif
+    }
+
+    bool available() const {
+#ifdef __linux__
+        return _groups[0].leader >= 0;
+#else
+        return false;
+#endif
+    }
+
+    // На сколько групп пришлось разделить счетчики. Для отладки.
+    int groups() const {
+#ifdef __linux__
+        return available() ? _group_count : 0;
+#else
+        return 0;
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int g = 0; g < _group_count; g++) {
+            ioctl(_groups[g].leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(_groups[g].leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    PerfCounts stop() {
+        PerfCounts counts;
+#ifdef __linux__
+        for (int g = 0; g < _group_count; g++) {
+            ioctl(_groups[g].leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        }
+        for (int g = 0; g < _group_count; g++) {
+            read_group(_groups[g], counts);
+        }
+#endif
+        return counts;
+    }
+
+private:
+#ifdef __linux__
+    struct Group {
+        int leader = -1;
+        int fds[PERF_EVENTS_COUNT];
+        int events[PERF_EVENTS_COUNT]; // события в порядке открытия
+        int opened = 0;
+    };
+
+    Group _groups[PERF_EVENTS_COUNT];
+    int _group_count = 0;
+
+    void close_all() {
+        for (int g = 0; g < _group_count; g++) {
+            for (int i = 0; i < _groups[g].opened; i++) {
+                close(_groups[g].fds[i]);
+            }
+            _groups[g] = Group();
+        }
+        _group_count = 0;
+    }
+
+    // Открывает события по группам layout. Группа, у которой не открылось ни одно событие,
+    // пропускается; первый открывшийся счетчик группы становится ее лидером.
+    void open(const int (&layout)[PERF_EVENTS_COUNT]) {
+        close_all();
+        for (int group = 0; group < PERF_EVENTS_COUNT; group++) {
+            Group &current = _groups[_group_count];
+            for (int i = 0; i < PERF_EVENTS_COUNT; i++) {
+                if (layout[i] != group) {
+                    continue;
+                }
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                set_event(i, attr);
+                attr.disabled = (current.leader < 0);
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, current.leader, 0);
+                if (fd < 0) {
+                    continue;
+                }
+                if (current.leader < 0) {
+                    current.leader = fd;
+                }
+                current.fds[current.opened] = fd;
+                current.events[current.opened++] = i;
+            }
+            if (current.leader >= 0) {
+                _group_count++;
+            }
+        }
+    }
+
+    // Все ли группы хоть раз попали на PMU за короткий пробный цикл.
+    bool scheduled() {
+        start();
+        volatile uint64_t sink = 0;
+        for (int i = 0; i < 100000; i++) {
+            sink = sink + i;
+        }
+        PerfCounts counts = stop();
+        for (int g = 0; g < _group_count; g++) {
+            if (!counts.valid[_groups[g].events[0]]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Формат: число счетчиков, время включения и время работы группы, затем значения
+    // в порядке открытия.
+    static void read_group(const Group &group, PerfCounts &counts) {
+        uint64_t buffer[3 + PERF_EVENTS_COUNT];
+        ssize_t got = read(group.leader, buffer, sizeof(buffer));
+        if (got < 3 * (ssize_t)sizeof(uint64_t)) {
+            return;
+        }
+        uint64_t enabled = buffer[1], running = buffer[2];
+        // Группа ни разу не попала на PMU: значения нулевые, но это не замер.
+        if (running == 0) {
+            return;
+        }
+        uint64_t values = std::min(buffer[0], (uint64_t)group.opened);
+        values = std::min(values, (uint64_t)got / sizeof(uint64_t) - 3);
+        for (uint64_t i = 0; i < values; i++) {
+            uint64_t value = buffer[3 + i];
+            // Группа делила PMU с другими и считала только часть времени: масштабируем.
+            if (running < enabled) {
+                value = (uint64_t)((double)value * enabled / running);
+            }
+            counts.values[group.events[i]] = value;
+            counts.valid[group.events[i]] = true;
+        }
+    }
+
+    static uint64_t cache_miss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    static void set_event(int event, perf_event_attr &attr) {
+        attr.type = PERF_TYPE_HARDWARE;
+        switch (event) {
+            case PERF_CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case PERF_INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case PERF_BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            case PERF_L1D_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = cache_miss(PERF_COUNT_HW_CACHE_L1D);
+                break;
+            case PERF_LLC_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = cache_miss(PERF_COUNT_HW_CACHE_LL);
+                break;
+            case PERF_DTLB_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = cache_miss(PERF_COUNT_HW_CACHE_DTLB);
+                break;
+        }
+    }
+#endif
+};
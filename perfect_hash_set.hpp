@@ -0,0 +1,229 @@
+#pragma once
+
+// Статический индекс для множеств, которые строятся один раз, а проверяются очень много раз
+// (черные списки, списки сегментов). Построен на минимальной совершенной хеш-функции
+// в духе PTHash: каждый ключ получает свой номер от 0 до size() - 1 без коллизий, а ключи
+// лежат в массиве по этим номерам. Поиск - чтение одного "пилота" и одного слота ключа,
+// и для попадания, и для промаха, без пробирования.
+//
+// Построение: ключи раскладываются по корзинам (в среднем BUCKET_SIZE ключей на корзину).
+// Корзины от больших к маленьким получают пилот - наименьшее число p, при котором
+// position(h(x), p) для всех ключей корзины попадают в свободные и разные ячейки таблицы
+// размера size() / LOAD_FACTOR. Потом ключи из ячеек за size() переносятся в свободные
+// ячейки внутри [0, size()), для них хранится таблица переноса.
+//
+// Память на ключ: 4 байта ключа, 2 / BUCKET_SIZE = 0.4 байта пилотов и около 0.12 байта
+// таблицы переноса, против 10 байт у FastIntHashSet(2 * n).
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "count_intersection.hpp"
+
+class PerfectHashSet {
+public:
+    static const size_t NOT_FOUND = SIZE_MAX;
+    static const int BUCKET_SIZE = 5;
+    // Сколько раз пробовать другое зерно хеша, если какой-то корзине не хватило 16 бит пилота.
+    static const int MAX_SEEDS = 16;
+
+    PerfectHashSet() = default;
+
+    // Повторы в values допустимы, в индекс каждое значение попадает один раз.
+    // Если ни одно из max_seeds зерен не подошло, built() == false и индексом пользоваться нельзя.
+    explicit PerfectHashSet(IntArrayView values, int max_seeds = MAX_SEEDS) {
+        for (_seed = 0; _seed < (uint64_t)max_seeds; _seed++) {
+            if (build(values)) {
+                _built = true;
+                return;
+            }
+        }
+        // Для различных 32-битных ключей такого практически не бывает: вероятность неудачи
+        // для одного зерна ничтожна. Но пустой индекс молча отвечал бы "нет" на все ключи,
+        // поэтому неудачу видно в built(), и вызывающий должен взять другую структуру.
+        _keys.clear();
+        _pilots.clear();
+        _remap.clear();
+        _table_size = 0;
+    }
+
+    // Построился ли индекс. Пустое множество тоже строится.
+    bool built() const {
+        return _built;
+    }
+
+    size_t size() const {
+        return _keys.size();
+    }
+
+    // Номер element в keys() или NOT_FOUND.
+    size_t index(int element) const {
+        if (_keys.empty()) {
+            return NOT_FOUND;
+        }
+        uint64_t h = key_hash(element);
+        size_t i = position(h, _pilots[reduce(h, _pilots.size())]);
+        if (i >= _keys.size()) {
+            i = _remap[i - _keys.size()];
+        }
+        return _keys[i] == element ? i : NOT_FOUND;
+    }
+
+    bool contains(int element) const {
+        return index(element) != NOT_FOUND;
+    }
+
+    // Сколько элементов probe есть в множестве.
+    int count_in(IntArrayView probe) const {
+        int ans = 0;
+        for (auto e : probe) {
+            ans += contains(e);
+        }
+        return ans;
+    }
+
+    // Ключи в порядке номеров.
+    IntArrayView keys() const {
+        return _keys;
+    }
+
+    size_t memory_bytes() const {
+        return _keys.size() * sizeof(int) + _pilots.size() * sizeof(uint16_t) + _remap.size() * sizeof(uint32_t);
+    }
+
+private:
+    // Доля занятых ячеек таблицы перед переносом. Чем ближе к 1, тем дольше ищутся пилоты
+    // последних корзин, но тем меньше таблица переноса.
+    static constexpr double LOAD_FACTOR = 0.97;
+
+    vector<int> _keys;
+    vector<uint16_t> _pilots;
+    vector<uint32_t> _remap;  // куда перенесена ячейка _keys.size() + i
+    size_t _table_size = 0;
+    uint64_t _seed = 0;
+    bool _built = false;
+
+    // Финализатор MurmurHash3, биекция на 64-битных числах.
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Разные ключи дают разные хеши, так что повторы видны по равенству хешей.
+    uint64_t key_hash(int element) const {
+        return mix((uint32_t)element + _seed * 0x9E3779B97F4A7C15ull);
+    }
+
+    // Корзина берется из старших бит h, поэтому ячейку считаем от перемешанного h:
+    // иначе ключи одной корзины всегда падали бы в соседние ячейки.
+    size_t position(uint64_t h, uint16_t pilot) const {
+        return reduce(mix(h ^ (pilot + 1) * 0xC2B2AE3D27D4EB4Full), _table_size);
+    }
+
+    // h в [0, n) умножением вместо деления.
+    static size_t reduce(uint64_t h, size_t n) {
+        return (size_t)(((unsigned __int128)h * n) >> 64);
+    }
+
+    bool build(IntArrayView values) {
+        size_t buckets = max((size_t)1, values.size() / BUCKET_SIZE);
+        // Раскладываем хеши по корзинам подсчетом.
+        vector<uint32_t> bucket_begin(buckets + 1, 0);
+        vector<uint64_t> hashes(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            hashes[i] = key_hash(values[i]);
+            ++bucket_begin[reduce(hashes[i], buckets) + 1];
+        }
+        for (size_t b = 0; b < buckets; b++) {
+            bucket_begin[b + 1] += bucket_begin[b];
+        }
+        vector<uint64_t> grouped(values.size());
+        {
+            vector<uint32_t> fill(begin(bucket_begin), end(bucket_begin) - 1);
+            for (auto h : hashes) {
+                grouped[fill[reduce(h, buckets)]++] = h;
+            }
+        }
+        vector<uint64_t>().swap(hashes);
+
+        // Повторы убираем внутри корзины, сами корзины упорядочиваем от больших к маленьким.
+        vector<uint32_t> bucket_size(buckets);
+        size_t keys = 0;
+        uint32_t max_bucket_size = 0;
+        for (size_t b = 0; b < buckets; b++) {
+            auto first = begin(grouped) + bucket_begin[b], last = begin(grouped) + bucket_begin[b + 1];
+            sort(first, last);
+            bucket_size[b] = unique(first, last) - first;
+            keys += bucket_size[b];
+            max_bucket_size = max(max_bucket_size, bucket_size[b]);
+        }
+        vector<uint32_t> order(buckets);
+        {
+            vector<uint32_t> by_size(max_bucket_size + 2, 0);
+            for (auto s : bucket_size) {
+                ++by_size[max_bucket_size - s + 1];
+            }
+            for (size_t s = 0; s <= max_bucket_size; s++) {
+                by_size[s + 1] += by_size[s];
+            }
+            for (size_t b = 0; b < buckets; b++) {
+                order[by_size[max_bucket_size - bucket_size[b]]++] = b;
+            }
+        }
+
+        _table_size = max(keys, (size_t)(keys / LOAD_FACTOR));
+        _pilots.assign(buckets, 0);
+        vector<uint64_t> taken(_table_size / 64 + 1, 0);
+        vector<size_t> slots(max_bucket_size);
+        for (auto b : order) {
+            const uint64_t *bucket = grouped.data() + bucket_begin[b];
+            uint32_t size = bucket_size[b];
+            if (size == 0) {
+                break;
+            }
+            bool found = false;
+            for (uint32_t pilot = 0; pilot <= UINT16_MAX && !found; pilot++) {
+                found = true;
+                for (uint32_t k = 0; k < size && found; k++) {
+                    slots[k] = position(bucket[k], pilot);
+                    found = !((taken[slots[k] >> 6] >> (slots[k] & 63)) & 1)
+                        && find(slots.data(), slots.data() + k, slots[k]) == slots.data() + k;
+                }
+                if (found) {
+                    _pilots[b] = pilot;
+                    for (uint32_t k = 0; k < size; k++) {
+                        taken[slots[k] >> 6] |= uint64_t(1) << (slots[k] & 63);
+                    }
+                }
+            }
+            if (!found) {
+                return false;
+            }
+        }
+
+        // Занятые ячейки за keys переносим в свободные ячейки [0, keys) по порядку.
+        _remap.assign(_table_size - keys, 0);
+        size_t free_slot = 0;
+        for (size_t i = keys; i < _table_size; i++) {
+            if ((taken[i >> 6] >> (i & 63)) & 1) {
+                while ((taken[free_slot >> 6] >> (free_slot & 63)) & 1) {
+                    ++free_slot;
+                }
+                _remap[i - keys] = free_slot++;
+            }
+        }
+
+        _keys.assign(keys, 0);
+        for (auto e : values) {
+            uint64_t h = key_hash(e);
+            size_t i = position(h, _pilots[reduce(h, buckets)]);
+            _keys[i < keys ? i : _remap[i - keys]] = e;
+        }
+        return true;
+    }
+};
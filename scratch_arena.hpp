@@ -0,0 +1,122 @@
+#pragma once
+
+// Память под временные буферы одного потока (хеш-таблицы, битовые маски).
+// Арена только растет и не возвращает память системе, поэтому после первых
+// запросов горячий путь вообще не вызывает malloc.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+class ScratchArena {
+public:
+    static const size_t ALIGNMENT = 64; // по кэш-линии
+    static const size_t MIN_BLOCK_SIZE = 64 * 1024;
+    // Больше этого между запросами не держим: один огромный запрос не должен навсегда занять память потока.
+    static const size_t MAX_RETAINED_SIZE = 64 * 1024 * 1024;
+
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+
+    // Все, что выделено, пока жив Scope, освобождается в его деструкторе.
+    // Scope'ы вкладываются как стек.
+    class Scope {
+    public:
+        explicit Scope(ScratchArena &arena) : _arena(arena), _block(arena._block), _offset(arena._offset) {
+            ++_arena._scopes;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        ~Scope() {
+            _arena._block = _block;
+            _arena._offset = _offset;
+            if (--_arena._scopes == 0) {
+                _arena.merge_blocks();
+            }
+        }
+
+        ScratchArena &arena() {
+            return _arena;
+        }
+
+    private:
+        ScratchArena &_arena;
+        size_t _block;
+        size_t _offset;
+    };
+
+    void *allocate(size_t bytes) {
+        bytes = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        while (_block < _blocks.size() && _offset + bytes > _blocks[_block].size) {
+            ++_block;
+            _offset = 0;
+        }
+        if (_block == _blocks.size()) {
+            size_t last = _blocks.empty() ? 0 : _blocks.back().size;
+            add_block(max(max(bytes, 2 * last), (size_t)MIN_BLOCK_SIZE));
+        }
+        void *result = _blocks[_block].data + _offset;
+        _offset += bytes;
+        return result;
+    }
+
+    template <class T>
+    T *allocate_array(size_t count) {
+        return static_cast<T *>(allocate(count * sizeof(T)));
+    }
+
+    // Сколько памяти арена держит сейчас.
+    size_t reserved() const {
+        size_t total = 0;
+        for (auto &block : _blocks) {
+            total += block.size;
+        }
+        return total;
+    }
+
+private:
+    struct Block {
+        unique_ptr<char[]> memory;
+        char *data; // memory, выровненная по ALIGNMENT
+        size_t size;
+    };
+
+    vector<Block> _blocks;
+    size_t _block = 0;
+    size_t _offset = 0;
+    int _scopes = 0;
+
+    void add_block(size_t size) {
+        Block block;
+        block.memory.reset(new char[size + ALIGNMENT]);
+        uintptr_t address = reinterpret_cast<uintptr_t>(block.memory.get());
+        block.data = reinterpret_cast<char *>((address + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+        block.size = size;
+        _blocks.push_back(move(block));
+    }
+
+    // Когда ничего не занято, несколько блоков заменяем одним суммарного размера,
+    // чтобы следующий такой же запрос уместился в один блок.
+    void merge_blocks() {
+        size_t total = reserved();
+        if (total > MAX_RETAINED_SIZE) {
+            _blocks.clear();
+        } else if (_blocks.size() > 1) {
+            _blocks.clear();
+            add_block(total);
+        }
+        _block = 0;
+        _offset = 0;
+    }
+};
+
+inline ScratchArena &thread_scratch_arena() {
+    static thread_local ScratchArena arena;
+    return arena;
+}
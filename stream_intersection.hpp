@@ -0,0 +1,194 @@
+#pragma once
+
+// Пересечение с larger, который не помещается в память: файл на несколько гигабайт или pipe.
+// По smaller строится хеш-таблица, а larger читается кусками фиксированного размера.
+// Отдельный поток читает следующий кусок, пока текущий проверяется по таблице,
+// поэтому ввод-вывод идет параллельно с подсчетом. Памяти нужно: таблица + два куска.
+//
+// Формат потока: подряд идущие int32 в порядке байт машины (как данные в int_set_file.hpp).
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "count_intersection.hpp"
+
+// 1 МБ: достаточно, чтобы накладные расходы на синхронизацию потоков были незаметны,
+// и мало, чтобы кусок лежал в L2/L3 к моменту проверки.
+const size_t STREAM_CHUNK_ELEMENTS = 1 << 18;
+
+// Двойной буфер с потоком-читателем. Читатель заполняет куски целиком (короткие read из pipe
+// дочитываются), поэтому неполным бывает только последний кусок.
+class StreamChunkReader {
+public:
+    StreamChunkReader(int fd, size_t chunk_elements) : _fd(fd), _chunk_elements(max(chunk_elements, (size_t)1)) {
+        for (auto &slot : _slots) {
+            slot.values.resize(_chunk_elements);
+        }
+        _reader = thread([this] { read_loop(); });
+    }
+
+    StreamChunkReader(const StreamChunkReader &) = delete;
+    StreamChunkReader &operator=(const StreamChunkReader &) = delete;
+
+    ~StreamChunkReader() {
+        {
+            lock_guard<mutex> guard(_lock);
+            _stopped = true;
+        }
+        _changed.notify_all();
+        _reader.join();
+    }
+
+    // Следующий кусок; пустой на конце потока или при ошибке.
+    // Кусок действителен до следующего вызова next().
+    IntArrayView next() {
+        unique_lock<mutex> guard(_lock);
+        if (_current >= 0) {
+            _slots[_current].ready = false;
+            _changed.notify_all();
+            _current ^= 1;
+        } else {
+            _current = 0;
+        }
+        Slot &slot = _slots[_current];
+        _changed.wait(guard, [&] { return slot.ready; });
+        return IntArrayView(slot.values.data(), slot.size);
+    }
+
+    // Сколько элементов прочитано всего (только после конца потока).
+    uint64_t elements() const {
+        return _elements;
+    }
+
+    bool failed() const {
+        return !_error.empty();
+    }
+
+    const string &error() const {
+        return _error;
+    }
+
+private:
+    struct Slot {
+        vector<int> values;
+        size_t size = 0;
+        bool ready = false;
+    };
+
+    int _fd;
+    size_t _chunk_elements;
+    Slot _slots[2];
+    int _current = -1;
+    bool _stopped = false;
+    uint64_t _elements = 0;
+    string _error;
+    mutex _lock;
+    condition_variable _changed;
+    thread _reader;
+
+    // Читает до size байт; меньше только на конце потока. -1 при ошибке.
+    ssize_t read_full(char *buffer, size_t size) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t got = ::read(_fd, buffer + done, size - done);
+            if (got == 0) {
+                break;
+            }
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += got;
+        }
+        return done;
+    }
+
+    void read_loop() {
+        for (int index = 0; ; index ^= 1) {
+            Slot &slot = _slots[index];
+            {
+                unique_lock<mutex> guard(_lock);
+                _changed.wait(guard, [&] { return !slot.ready || _stopped; });
+                if (_stopped) {
+                    return;
+                }
+            }
+
+            ssize_t bytes = read_full(reinterpret_cast<char *>(slot.values.data()), _chunk_elements * sizeof(int));
+            string error;
+            if (bytes < 0) {
+                error = strerror(errno);
+                bytes = 0;
+            } else if (bytes % sizeof(int) != 0) {
+                error = "stream size is not a multiple of 4 bytes";
+            }
+
+            lock_guard<mutex> guard(_lock);
+            slot.size = error.empty() ? bytes / sizeof(int) : 0;
+            slot.ready = true;
+            _elements += slot.size;
+            _error = error;
+            _changed.notify_all();
+            // Пустой кусок означает конец, дальше читать нечего.
+            if (slot.size == 0) {
+                return;
+            }
+        }
+    }
+};
+
+// Число элементов потока larger, которые есть в smaller. Поток читается до конца.
+// false, если чтение не удалось или поток оборвался посреди числа; тогда count не определен.
+// count 64-битный: в потоке на несколько гигабайт совпадений бывает больше 2^31.
+inline bool count_intersection_stream(IntArrayView smaller, int fd, uint64_t &count, string *error = nullptr,
+                                      size_t chunk_elements = STREAM_CHUNK_ELEMENTS) {
+    count = 0;
+    if (2 * max(smaller.size(), (size_t)1) > MAX_HASH_SET_CAPACITY) {
+        if (error) {
+            *error = "smaller is too large for a hash table";
+        }
+        return false;
+    }
+    StreamChunkReader reader(fd, chunk_elements);
+    // Таблицу строим, пока читатель уже грузит первый кусок.
+    with_empty_hash_set(2 * max(smaller.size(), (size_t)1), [&](FastIntHashSet &hash_set) {
+        for (auto e : smaller) {
+            hash_set.add(e);
+        }
+        for (IntArrayView chunk = reader.next(); !chunk.empty(); chunk = reader.next()) {
+            count += hash_set.count_contained(chunk);
+        }
+        return 0;
+    });
+    if (reader.failed() && error) {
+        *error = reader.error();
+    }
+    return !reader.failed();
+}
+
+inline bool count_intersection_stream(IntArrayView smaller, const string &path, uint64_t &count, string *error = nullptr,
+                                      size_t chunk_elements = STREAM_CHUNK_ELEMENTS) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (error) {
+            *error = path + ": " + strerror(errno);
+        }
+        return false;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    bool ok = count_intersection_stream(smaller, fd, count, error, chunk_elements);
+    ::close(fd);
+    return ok;
+}
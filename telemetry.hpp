@@ -0,0 +1,198 @@
+#pragma once
+
+// Телеметрия count_intersection: сколько раз выбран каждый алгоритм, сколько байт
+// обработано и гистограммы времени по классам размера входа.
+//
+// Каждый поток пишет только в свой шард, поэтому атомарные операции read-modify-write
+// не нужны: владелец делает load + store, а snapshot() читает шарды всех потоков
+// и складывает. Шард завершившегося потока переливается в общий итог.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+const int TELEMETRY_MAX_STRATEGIES = 8;
+
+// Класс размера по m + n: [0, 8), [8, 64), [64, 512), ... , [2^21, inf).
+const int TELEMETRY_SIZE_CLASSES = 8;
+
+inline int telemetry_size_class(size_t elements) {
+    int log = 0;
+    while (elements >>= 1) {
+        ++log;
+    }
+    return min(log / 3, TELEMETRY_SIZE_CLASSES - 1);
+}
+
+// Гистограмма в духе HDR: на каждую степень двойки 4 корзины, т.е. точность около 25%.
+// Значения в наносекундах, последняя корзина собирает и все, что больше 2^40 нс.
+struct LatencyHistogram {
+    static const int SUB_BUCKET_BITS = 2;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_EXPONENT = 40;
+    static const int BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+    uint64_t counts[BUCKETS] = {};
+
+    static int bucket(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (int)value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent > MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+        int sub = (int)(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    // Нижняя граница значений, попадающих в корзину.
+    static uint64_t bucket_low(int index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t sub = index % SUB_BUCKETS;
+        return (uint64_t(1) << exponent) | (sub << (exponent - SUB_BUCKET_BITS));
+    }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (auto count : counts) {
+            sum += count;
+        }
+        return sum;
+    }
+
+    // Нижняя граница корзины, в которой лежит квантиль q (0 <= q <= 1).
+    uint64_t percentile(double q) const {
+        uint64_t all = total();
+        if (all == 0) {
+            return 0;
+        }
+        uint64_t need = (uint64_t)(q * (all - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= need) {
+                return bucket_low(i);
+            }
+        }
+        return bucket_low(BUCKETS - 1);
+    }
+
+    LatencyHistogram &operator+=(const LatencyHistogram &other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        return *this;
+    }
+};
+
+struct TelemetrySnapshot {
+    uint64_t calls[TELEMETRY_MAX_STRATEGIES] = {};
+    uint64_t bytes[TELEMETRY_MAX_STRATEGIES] = {};
+    LatencyHistogram latency[TELEMETRY_MAX_STRATEGIES][TELEMETRY_SIZE_CLASSES];
+};
+
+// Экземпляр один на процесс (Telemetry::instance()): шард потока привязывается к нему
+// при первой записи, поэтому второй экземпляр писал бы в шарды первого.
+class Telemetry {
+public:
+    static Telemetry &instance() {
+        static Telemetry telemetry;
+        return telemetry;
+    }
+
+    Telemetry(const Telemetry &) = delete;
+    Telemetry &operator=(const Telemetry &) = delete;
+
+    // Время мерить дороже, чем считать вызовы (два вызова часов), поэтому оно включается отдельно.
+    void set_latency_enabled(bool enabled) {
+        _latency_enabled.store(enabled, memory_order_relaxed);
+    }
+
+    bool latency_enabled() const {
+        return _latency_enabled.load(memory_order_relaxed);
+    }
+
+    void record_call(int strategy, uint64_t bytes) {
+        Shard &shard = local_shard();
+        bump(shard.calls[strategy], 1);
+        bump(shard.bytes[strategy], bytes);
+    }
+
+    void record_latency(int strategy, size_t elements, uint64_t nanoseconds) {
+        Shard &shard = local_shard();
+        bump(shard.latency[strategy][telemetry_size_class(elements)][LatencyHistogram::bucket(nanoseconds)], 1);
+    }
+
+    TelemetrySnapshot snapshot() {
+        lock_guard<mutex> guard(_lock);
+        TelemetrySnapshot result = _retired;
+        for (auto shard : _shards) {
+            add(result, *shard);
+        }
+        return result;
+    }
+
+private:
+    Telemetry() = default;
+
+    struct Shard {
+        atomic<uint64_t> calls[TELEMETRY_MAX_STRATEGIES] = {};
+        atomic<uint64_t> bytes[TELEMETRY_MAX_STRATEGIES] = {};
+        atomic<uint64_t> latency[TELEMETRY_MAX_STRATEGIES][TELEMETRY_SIZE_CLASSES][LatencyHistogram::BUCKETS] = {};
+    };
+
+    // Регистрирует шард потока при первом обращении и переливает его в _retired при завершении потока.
+    struct ShardOwner {
+        Telemetry &telemetry;
+        Shard *shard;
+
+        explicit ShardOwner(Telemetry &owner) : telemetry(owner), shard(new Shard()) {
+            lock_guard<mutex> guard(telemetry._lock);
+            telemetry._shards.push_back(shard);
+        }
+
+        ~ShardOwner() {
+            lock_guard<mutex> guard(telemetry._lock);
+            add(telemetry._retired, *shard);
+            telemetry._shards.erase(find(begin(telemetry._shards), end(telemetry._shards), shard));
+            delete shard;
+        }
+    };
+
+    atomic<bool> _latency_enabled{false};
+    mutex _lock;
+    vector<Shard *> _shards;
+    TelemetrySnapshot _retired;
+
+    // Пишет только поток-владелец, поэтому достаточно load + store без lock-префикса.
+    static void bump(atomic<uint64_t> &counter, uint64_t delta) {
+        counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    static void add(TelemetrySnapshot &result, const Shard &shard) {
+        for (int s = 0; s < TELEMETRY_MAX_STRATEGIES; s++) {
+            result.calls[s] += shard.calls[s].load(memory_order_relaxed);
+            result.bytes[s] += shard.bytes[s].load(memory_order_relaxed);
+            for (int c = 0; c < TELEMETRY_SIZE_CLASSES; c++) {
+                for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+                    result.latency[s][c].counts[b] += shard.latency[s][c][b].load(memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    // Экземпляр один, поэтому и шард у потока один.
+    Shard &local_shard() {
+        static thread_local ShardOwner owner(*this);
+        return *owner.shard;
+    }
+};
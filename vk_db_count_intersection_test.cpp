@@ -1,118 +1,29 @@
 #include <vector>
 #include <algorithm>
-#include <cstddef>
-#include <cstdint>
+#include <random>
+#include <set>
+#include <numeric>
+#include <thread>
+#include <climits>
+#include <poll.h>
+
+#include "count_intersection.hpp"
+#include "int_set_file.hpp"
+#include "stream_intersection.hpp"
+#include "compressed_list.hpp"
+#include "external_intersection.hpp"
+#include "int_text_parser.hpp"
+#include "interleaved_probe.hpp"
+#include "intersection_executor.hpp"
+#include "intersection_server.hpp"
+#include "hash_set_snapshot.hpp"
+#include "perfect_hash_set.hpp"
+#include "intersection_library.hpp"
 
 // Для тестов использую Catch2 https://github.com/catchorg/Catch2
-#define CATCH_CONFIG_MAIN
+// main лежит в vk_db_count_intersection_test_main.cpp.
 #include "catch.hpp"
 
-using namespace std;
-
-// Стандартные хеш-таблици std::unordered_set и std::unordered_map работают с
-// невероятно большой константой, поэтому пишем свою с открытой адресацией и
-// минимальным необходимым функционалом.
-class FastIntHashSet {
-public:
-    FastIntHashSet(int capacity) : _array(capacity), _status(capacity, false) {}
-
-    void add(int element) {
-        size_t i = get_index(element);
-        if (!_status[i]) {
-            _array[i] = element;
-            _status[i] = true;
-            ++_size;
-        }
-    }
-
-    bool contains(int element) const {
-        return _status[get_index(element)];
-    }
-
-    size_t size() const {
-        return _size;
-    }
-
-    size_t capacity() const {
-        return _array.size();
-    }
-
-    // Взял отсюда https://gist.github.com/badboy/6267743
-    static uint32_t good_hash(uint32_t a) {
-       a = (a+0x7ed55d16) + (a<<12);
-       a = (a^0xc761c23c) ^ (a>>19);
-       a = (a+0x165667b1) + (a<<5);
-       a = (a+0xd3a2646c) ^ (a<<9);
-       a = (a+0xfd7046c5) + (a<<3);
-       a = (a^0xb55a4f09) ^ (a>>16);
-       return a;
-    }
-
-private:
-    vector<int> _array;
-    vector<char> _status; // vector<char> работает быстрее чем vector<bool>. Если память важна, то можно поменять.
-    size_t _size = 0;
-
-    size_t get_index(int element) const {
-        int i = good_hash(element) % _array.size();
-        while (_status[i] && _array[i] != element) {
-            if (++i == (int)_array.size()) {
-                i = 0;
-            }
-        }
-        return i;
-    }
-};
-
-// Решение с хеш-таблицей. Считаем что 0 < smaller.size() <= larger.size().
-int count_intersection_by_hash(const vector<int> &smaller, const vector<int> &larger) {
-    int ans = 0;
-
-    FastIntHashSet hash_set(2 * smaller.size());
-
-    for (auto e : smaller) {
-        hash_set.add(e);
-    }
-
-    for (auto e : larger) {
-        ans += hash_set.contains(e);
-    }
-    return ans;
-}
-
-// Простое решение. Считаем что 0 < smaller.size() <= larger.size().
-int count_intersection_by_find(const vector<int> &smaller, const vector<int> &larger) {
-    int ans = 0;
-
-    // Вложенность именно такая, так как маленький массив кэшируется процессором
-    for (auto e : larger) {
-        ans += (find(begin(smaller), end(smaller), e) != end(smaller));
-    }
-
-    return ans;
-}
-
-// Полное решение
-int count_intersection(const vector<int> &first_array, const vector<int> &second_array) {
-
-    if (min(first_array.size(), second_array.size()) == 0) {
-        return 0;
-    }
-
-    const vector<int> *smaller_ptr = &first_array;
-    const vector<int> *larger_ptr = &second_array;
-    if (smaller_ptr->size() > larger_ptr->size()) {
-        swap(smaller_ptr, larger_ptr);
-    }
-
-    const size_t MIN_SIZE_FOR_HASH = 110; // подобрал
-    if(smaller_ptr->size() < MIN_SIZE_FOR_HASH) {
-        return count_intersection_by_find(*smaller_ptr, *larger_ptr);
-    }
-
-    return count_intersection_by_hash(*smaller_ptr, *larger_ptr);
-}
-
 // Тесты
 // Мой первый опыт юнит тестирования на c++, так что не судите строго)
 
@@ -169,6 +80,270 @@ TEST_CASE( "FastIntHashSet unit tests", "[FastIntHashSet]" ) {
     }
 }
 
+TEST_CASE("FastIntHashSet clear and reset", "[FastIntHashSet]") {
+
+    FastIntHashSet h_table(100);
+
+    SECTION("clear removes everything") {
+        for (int i = 0; i < 40; i++) {
+            h_table.add(i);
+        }
+        h_table.clear();
+        REQUIRE(h_table.size() == 0);
+        REQUIRE(h_table.capacity() == 100);
+        for (int i = 0; i < 40; i++) {
+            REQUIRE(h_table.contains(i) == false);
+        }
+        REQUIRE(h_table.stats().clusters == 0);
+    }
+
+    SECTION("many clears survive epoch overflow") {
+        // Больше 255 поколений, чтобы метки переполнились несколько раз.
+        for (int round = 0; round < 1000; round++) {
+            h_table.add(round);
+            h_table.add(round + 1);
+            REQUIRE(h_table.size() == 2);
+            REQUIRE(h_table.contains(round));
+            REQUIRE(h_table.contains(round - 1) == false);
+            h_table.clear();
+        }
+    }
+
+    SECTION("reset to smaller and larger capacity") {
+        for (int round = 0; round < 600; round++) {
+            size_t capacity = round % 3 == 0 ? 10 : round % 3 == 1 ? 100 : 50;
+            h_table.reset(capacity);
+            REQUIRE(h_table.capacity() == capacity);
+            REQUIRE(h_table.size() == 0);
+            for (int i = 0; i < (int)capacity / 2; i++) {
+                REQUIRE(h_table.contains(round * 1000 + i) == false);
+                h_table.add(round * 1000 + i);
+            }
+            for (int i = 0; i < (int)capacity / 2; i++) {
+                REQUIRE(h_table.contains(round * 1000 + i));
+            }
+        }
+        h_table.reset(1000);
+        REQUIRE(h_table.capacity() == 1000);
+        REQUIRE(h_table.contains(599 * 1000) == false);
+    }
+
+    SECTION("thread table is reused") {
+        FastIntHashSet &first = thread_hash_set(64);
+        first.add(7);
+        FastIntHashSet &second = thread_hash_set(32);
+        REQUIRE(&first == &second);
+        REQUIRE(second.capacity() == 32);
+        REQUIRE(second.contains(7) == false);
+    }
+}
+
+TEST_CASE("FastIntHashSet count_contained", "[FastIntHashSet]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(-300, 300);
+
+    // Емкость не кратна 4, таблица почти полная, а в ней метки прошлых поколений:
+    // векторный путь должен совпадать с contains() и на коллизиях, и на хвосте probe.
+    for (size_t capacity : {1, 2, 3, 37, 101, 1000}) {
+        FastIntHashSet h_table(capacity);
+        for (int round = 0; round < 3; round++) {
+            h_table.clear();
+            for (size_t i = 0; i + 1 < capacity; i++) {
+                h_table.add(uid(gen));
+            }
+            for (size_t size : {0, 7, 8, 9, 1000}) {
+                vector<int> probe(size);
+                int expected = 0;
+                for (auto &e : probe) {
+                    e = uid(gen);
+                    expected += h_table.contains(e);
+                }
+                REQUIRE(h_table.count_contained(probe) == expected);
+            }
+        }
+    }
+}
+
+TEST_CASE("interleaved probing", "[FastIntHashSet][interleaved]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(-5000, 5000);
+
+    // Таблицы разного размера и заполненности, одна таблица в нескольких запросах, пустые probe.
+    vector<unique_ptr<FastIntHashSet>> sets;
+    for (size_t capacity : {1, 3, 64, 1000, 20000}) {
+        sets.emplace_back(new FastIntHashSet(capacity));
+        for (size_t i = 0; i + 1 < capacity && i < 8000; i++) {
+            sets.back()->add(uid(gen));
+        }
+    }
+    vector<vector<int>> probes;
+    vector<HashProbeQuery> queries;
+    for (int q = 0; q < 20; q++) {
+        probes.emplace_back(q % 7 == 0 ? 0 : gen() % 3000);
+        for (auto &e : probes.back()) {
+            e = uid(gen);
+        }
+    }
+    for (int q = 0; q < 20; q++) {
+        queries.push_back({sets[q % sets.size()].get(), probes[q]});
+    }
+    vector<int> expected;
+    for (auto &query : queries) {
+        expected.push_back(query.set->count_contained(query.probe));
+    }
+
+    for (int group : {1, 2, 8, 32, 1000}) {
+        // Порог 0 - чередуются все таблицы, иначе маленькие идут в обход.
+        REQUIRE(count_contained_interleaved(queries, group, 0) == expected);
+        REQUIRE(count_contained_interleaved(queries, group) == expected);
+    }
+    REQUIRE(count_contained_interleaved({}).empty());
+}
+
+TEST_CASE("FastIntHashSet stats", "[FastIntHashSet]") {
+
+    SECTION("empty table") {
+        FastIntHashSet h_table(16);
+        FastIntHashSetStats stats = h_table.stats();
+        REQUIRE(stats.load_factor == 0);
+        REQUIRE(stats.max_hit_probe == 0);
+        REQUIRE(stats.average_miss_probe == 0);
+        REQUIRE(stats.clusters == 0);
+    }
+
+    SECTION("stats match brute force") {
+        int capacity = 1000;
+        FastIntHashSet h_table(capacity);
+        mt19937 gen(0);
+        vector<int> elements;
+        for (int i = 0; i < 600; i++) {
+            elements.push_back(gen());
+            h_table.add(elements.back());
+        }
+        FastIntHashSetStats stats = h_table.stats();
+        REQUIRE(stats.load_factor == Approx((double)h_table.size() / capacity));
+
+        // Повторяем вставки на своей модели таблицы и считаем пробы промахов в лоб.
+        vector<bool> occupied(capacity);
+        for (auto e : elements) {
+            size_t i = FastIntHashSet::home_slot(e, capacity);
+            while (occupied[i]) {
+                i = (i + 1) % capacity;
+            }
+            occupied[i] = true;
+        }
+        double miss_total = 0;
+        size_t miss_max = 0, clusters = 0;
+        for (int home = 0; home < capacity; home++) {
+            size_t probe = 0;
+            while (occupied[(home + probe) % capacity]) {
+                probe++;
+            }
+            miss_total += probe;
+            miss_max = max(miss_max, probe);
+            clusters += occupied[home] && !occupied[(home + capacity - 1) % capacity];
+        }
+        REQUIRE(stats.average_miss_probe == Approx(miss_total / capacity));
+        REQUIRE(stats.max_miss_probe == miss_max);
+        REQUIRE(stats.clusters == clusters);
+
+        size_t in_histogram = 0;
+        for (auto count : stats.cluster_histogram) {
+            in_histogram += count;
+        }
+        REQUIRE(in_histogram == clusters);
+        REQUIRE(stats.max_hit_probe < miss_max);
+        REQUIRE(stats.average_hit_probe <= stats.average_miss_probe);
+    }
+
+    SECTION("full table") {
+        FastIntHashSet h_table(8);
+        for (int i = 0; i < 8; i++) {
+            h_table.add(i);
+        }
+        FastIntHashSetStats stats = h_table.stats();
+        REQUIRE(stats.load_factor == 1);
+        REQUIRE(stats.clusters == 1);
+        REQUIRE(stats.max_miss_probe == 8);
+    }
+}
+
+TEST_CASE("ScratchArena", "[ScratchArena]") {
+
+    ScratchArena arena;
+    REQUIRE(arena.reserved() == 0);
+
+    SECTION("aligned allocations inside nested scopes") {
+        ScratchArena::Scope outer(arena);
+        char *a = arena.allocate_array<char>(1);
+        int *b = arena.allocate_array<int>(100);
+        REQUIRE(reinterpret_cast<uintptr_t>(a) % ScratchArena::ALIGNMENT == 0);
+        REQUIRE(reinterpret_cast<uintptr_t>(b) % ScratchArena::ALIGNMENT == 0);
+        REQUIRE((char *)b >= a + 1);
+        {
+            ScratchArena::Scope inner(arena);
+            int *c = arena.allocate_array<int>(10);
+            REQUIRE((char *)c >= (char *)(b + 100));
+        }
+        // После выхода из вложенного Scope та же память выдается снова.
+        ScratchArena::Scope inner(arena);
+        int *d = arena.allocate_array<int>(10);
+        REQUIRE((char *)d >= (char *)(b + 100));
+        REQUIRE(arena.allocate_array<int>(10) > d);
+    }
+
+    SECTION("blocks are merged and reused") {
+        {
+            ScratchArena::Scope scope(arena);
+            for (int i = 0; i < 10; i++) {
+                arena.allocate(ScratchArena::MIN_BLOCK_SIZE);
+            }
+        }
+        size_t reserved = arena.reserved();
+        REQUIRE(reserved >= 10 * ScratchArena::MIN_BLOCK_SIZE);
+        {
+            ScratchArena::Scope scope(arena);
+            for (int i = 0; i < 10; i++) {
+                arena.allocate(ScratchArena::MIN_BLOCK_SIZE);
+            }
+        }
+        REQUIRE(arena.reserved() == reserved);
+    }
+
+    SECTION("FastIntHashSet in arena") {
+        ScratchArena::Scope scope(arena);
+        FastIntHashSet h_table(100, arena);
+        REQUIRE(h_table.capacity() == 100);
+        for (int i = 0; i < 50; i++) {
+            REQUIRE(h_table.contains(i) == false);
+            h_table.add(i);
+        }
+        REQUIRE(h_table.size() == 50);
+        for (int i = 0; i < 50; i++) {
+            REQUIRE(h_table.contains(i));
+        }
+        // Проверка идет до выделения памяти, так что арена не растет.
+        size_t reserved = arena.reserved();
+        REQUIRE_THROWS_AS(FastIntHashSet(MAX_HASH_SET_CAPACITY + 1, arena), length_error);
+        REQUIRE(arena.reserved() == reserved);
+    }
+
+    SECTION("kernels do not grow the thread arena after warm up") {
+        vector<int> smaller(5000), larger(20000);
+        iota(begin(smaller), end(smaller), 0);
+        iota(begin(larger), end(larger), 2500);
+        REQUIRE(count_intersection_by_hash(smaller, larger) == 2500);
+        REQUIRE(count_intersection_by_bitmap(smaller, larger) == 2500);
+        size_t reserved = thread_scratch_arena().reserved();
+        REQUIRE(reserved > 0);
+        for (int i = 0; i < 10; i++) {
+            REQUIRE(count_intersection_by_hash(smaller, larger) == 2500);
+            REQUIRE(count_intersection_by_bitmap(smaller, larger) == 2500);
+        }
+        REQUIRE(thread_scratch_arena().reserved() == reserved);
+    }
+}
+
 TEST_CASE("count_intersection unit tests", "[count_intersection]") {
 
     SECTION("intersect two empty vectors") {
@@ -356,76 +531,1183 @@ TEST_CASE("count_intersection stress", "[count_intersection][stress]") {
     }
 }
 
-// Проверка скорости. Работает только на windows.
-
-// #include <windows.h>
-//
-// double PCFreq = 0.0;
-// __int64 CounterStart = 0;
-//
-// void StartCounter() {
-//     LARGE_INTEGER li;
-//     QueryPerformanceFrequency(&li);
-//
-//     PCFreq = double(li.QuadPart)/1000.0;
-//
-//     QueryPerformanceCounter(&li);
-//     CounterStart = li.QuadPart;
-// }
-//
-// double GetCounter() {
-//     LARGE_INTEGER li;
-//     QueryPerformanceCounter(&li);
-//     return double(li.QuadPart-CounterStart)/PCFreq;
-// }
-//
-//
-// int count_intersection_by_sort(const vector<int> &smaller, const vector<int> &larger) {
-//     int ans = 0;
-//
-//     vector<int> smaller_cp(smaller);
-//     sort(begin(smaller_cp), end(smaller_cp));
-//
-//     for (auto e : larger) {
-//         auto it = lower_bound(begin(smaller_cp), end(smaller_cp), e);
-//         ans +=  (it != end(larger)) && (*it == e);
-//     }
-//
-//     return ans;
-// }
-//
-// TEST_CASE("speed test", "[!hide][speed]") {
-//
-//     mt19937 gen(0);
-//     const int MAX = 1e9;
-//     const size_t min_const = 110;
-//
-//     SECTION("tests") {
-//         int number_of_tests = 100;
-//         uniform_int_distribution<int> uid(-MAX, MAX);
-//         vector<int> smaller;
-//         vector<int> larger;
-//         for (int t = 0; t < number_of_tests; t++) {
-//             smaller = generator(gen, uid, min_const);
-//             larger = generator(gen, uid, 10000);
-//
-//             StartCounter();
-//             int by_sort = count_intersection_by_sort(smaller, larger);
-//             double time_sort = GetCounter();
-//
-//             StartCounter();
-//             int by_find = count_intersection_by_find(smaller, larger);
-//             double time_find = GetCounter();
-//
-//             StartCounter();
-//             int by_hash = count_intersection_by_hash(smaller, larger);
-//             double time_hash = GetCounter();
-//
-//             REQUIRE(by_sort == by_find);
-//             REQUIRE(by_hash == by_find);
-//             // CHECK(time_find > time_sort);
-//             // CHECK(time_hash > time_sort);
-//             CHECK(time_hash > time_find);
-//         }
-//     }
-// }
+TEST_CASE("count_intersection strategies", "[count_intersection][strategies]") {
+
+    mt19937 gen(0);
+
+    SECTION("all strategies agree") {
+        int number_of_tests = 100;
+        for (int t = 0; t < number_of_tests; t++) {
+            gen.discard(t);
+            // Чередуем плотные и разреженные значения, чтобы маска бывала и маленькой, и большой.
+            uniform_int_distribution<int> uid(t % 2 ? -1000 : -1000000000, t % 2 ? 1000 : 1000000000);
+            vector<int> smaller = generator(gen, uid, 1 + t * 3);
+            vector<int> larger = generator(gen, uid, 1000);
+            int expected = count_intersection_by_find(smaller, larger);
+
+            REQUIRE(count_intersection_by_hash(smaller, larger) == expected);
+            REQUIRE(count_intersection_by_sort(smaller, larger) == expected);
+            REQUIRE(count_intersection_by_bitmap(smaller, larger) == expected);
+            REQUIRE(count_intersection_by_eytzinger(smaller, larger) == expected);
+
+            sort(begin(smaller), end(smaller));
+            sort(begin(larger), end(larger));
+            REQUIRE(count_intersection_by_binary_search(smaller, larger) == expected);
+            REQUIRE(count_intersection_by_merge(smaller, larger) == expected);
+
+            IntersectionShape shape = describe_intersection(smaller, larger);
+            REQUIRE(shape.smaller_sorted);
+            REQUIRE(shape.larger_sorted);
+            for (int i = 0; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+                REQUIRE(count_intersection_with((IntersectionStrategy)i, shape, smaller, larger) == expected);
+            }
+            REQUIRE(count_intersection(smaller, larger) == expected);
+        }
+    }
+
+    SECTION("library entry points") {
+        uniform_int_distribution<int> uid(-1000000, 1000000);
+        for (size_t m : {1, 10, 1000, 20000}) {
+            vector<int> smaller = generator(gen, uid, m);
+            vector<int> larger = generator(gen, uid, 20000);
+            int expected = count_intersection(smaller, larger);
+
+            REQUIRE(vk_db::count_intersection(smaller, larger) == expected);
+            REQUIRE(vk_db::count_intersection(larger, smaller) == expected);
+            IntersectionShape shape = vk_db::describe_intersection(smaller, larger);
+            REQUIRE(shape.smaller_size == m);
+            for (int i = 0; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+                if (intersection_cost_model().cost((IntersectionStrategy)i, shape) != HUGE_VAL) {
+                    REQUIRE(vk_db::count_intersection_with((IntersectionStrategy)i, shape, smaller, larger) == expected);
+                }
+            }
+        }
+        REQUIRE(vk_db::count_intersection(IntArrayView(), IntArrayView()) == 0);
+    }
+
+    SECTION("fixed-size find kernels") {
+        uniform_int_distribution<int> uid(-100, 100);
+        for (size_t m = 1; m <= MAX_FIXED_FIND_SIZE; m++) {
+            gen.discard(m);
+            vector<int> smaller = generator(gen, uid, m);
+            // В larger бывают повторы, каждый засчитывается отдельно, как в by_find.
+            vector<int> larger(500);
+            for (auto &e : larger) {
+                e = uid(gen);
+            }
+            REQUIRE(count_intersection_by_find_small(smaller, larger) == count_intersection_by_find(smaller, larger));
+        }
+    }
+
+    SECTION("eytzinger on every tree size") {
+        // Все значения smaller и промахи между ними и по краям, в том числе INT32_MIN и INT32_MAX.
+        for (int m = 1; m <= 70; m++) {
+            vector<int> smaller, larger = {INT32_MIN, INT32_MAX};
+            for (int i = 0; i < m; i++) {
+                smaller.push_back(2 * i);
+                larger.push_back(2 * i);
+                larger.push_back(2 * i - 1);
+            }
+            larger.push_back(2 * m);
+            REQUIRE(count_intersection_by_eytzinger(IntArrayView(smaller.data(), smaller.size(), true), larger) == m);
+            smaller.push_back(INT32_MIN);
+            smaller.push_back(INT32_MAX);
+            REQUIRE(count_intersection_by_eytzinger(smaller, larger) == m + 2);
+        }
+    }
+
+    SECTION("bitmap on extreme values") {
+        vector<int> smaller = {INT32_MIN, INT32_MAX, 0};
+        vector<int> larger = {INT32_MAX, 1, INT32_MIN, -1, INT32_MIN + 1};
+        REQUIRE(count_intersection_by_bitmap(smaller, larger) == 2);
+    }
+
+    SECTION("cost model choice") {
+        IntersectionCostModel model;
+        IntersectionShape shape;
+
+        shape.smaller_size = 5;
+        shape.larger_size = 100000;
+        shape.smaller_span = 2000000000;
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_find);
+
+        shape.smaller_size = 10000;
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_hash);
+
+        shape.smaller_sorted = shape.larger_sorted = true;
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_merge);
+
+        shape.smaller_sorted = shape.larger_sorted = false;
+        shape.smaller_span = 20000;
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_bitmap);
+    }
+
+    SECTION("calibrated model is sane") {
+        IntersectionCostModel model = IntersectionCostModel::calibrate();
+        IntersectionShape shape;
+        shape.smaller_size = 2;
+        shape.larger_size = 100000;
+        shape.smaller_span = 2000000000;
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_find);
+        shape.smaller_size = 50000;
+        REQUIRE(model.choose(shape) != IntersectionStrategy::by_find);
+    }
+
+    SECTION("profile round trip") {
+        IntersectionCostModel model;
+        model.find_compare = 0.25;
+        model.hash_probe = 7.5;
+        string path = "out/test_profile.txt";
+        REQUIRE(model.save(path));
+
+        IntersectionCostModel loaded;
+        REQUIRE(loaded.load(path));
+        REQUIRE(loaded.find_compare == Approx(0.25));
+        REQUIRE(loaded.hash_probe == Approx(7.5));
+        REQUIRE(loaded.hash_build == Approx(model.hash_build));
+        REQUIRE(loaded.load("out/no_such_profile.txt") == false);
+    }
+
+    SECTION("decision table") {
+        IntersectionCostModel model;
+        IntersectionShape shape;
+        shape.smaller_size = 5;
+        shape.larger_size = 100000;
+        shape.smaller_span = 2000000000;
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_find);
+
+        // m = 5 -> 2, n / m = 20000 -> 14, разреженные значения -> 2
+        model.set_decision(2, 14, 2, IntersectionStrategy::by_sort);
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_sort);
+
+        // Клетка с неприменимым алгоритмом игнорируется.
+        model.set_decision(2, 14, 2, IntersectionStrategy::by_bitmap);
+        REQUIRE(model.choose(shape) == IntersectionStrategy::by_find);
+
+        model.set_decision(2, 14, 2, IntersectionStrategy::by_hash);
+        string path = "out/test_profile.txt";
+        REQUIRE(model.save(path));
+        IntersectionCostModel loaded;
+        REQUIRE(loaded.load(path));
+        REQUIRE(loaded.choose(shape) == IntersectionStrategy::by_hash);
+
+        // Отсортированные входы autotune не замерял, для них работают формулы.
+        shape.smaller_sorted = shape.larger_sorted = true;
+        REQUIRE(loaded.choose(shape) == IntersectionStrategy::by_find);
+    }
+}
+
+TEST_CASE("kernel perf counters", "[count_intersection][perf]") {
+
+    vector<int> smaller = {1, 2, 3, 4, 5};
+    vector<int> larger = {5, 6, 7, 8, 9, 10, 1};
+    IntersectionShape shape = describe_intersection(smaller, larger);
+
+    reset_kernel_perf_stats();
+    REQUIRE(count_intersection_with(IntersectionStrategy::by_hash, shape, smaller, larger) == 2);
+    // Пока счетчики выключены, ничего не записывается.
+    REQUIRE(kernel_perf_stats(IntersectionStrategy::by_hash).calls == 0);
+
+    set_kernel_perf_counters_enabled(true);
+    REQUIRE(count_intersection_with(IntersectionStrategy::by_hash, shape, smaller, larger) == 2);
+    REQUIRE(count_intersection_with(IntersectionStrategy::by_find, shape, smaller, larger) == 2);
+    REQUIRE(count_intersection_with(IntersectionStrategy::by_find, shape, smaller, larger) == 2);
+    set_kernel_perf_counters_enabled(false);
+
+    KernelPerfStats by_hash = kernel_perf_stats(IntersectionStrategy::by_hash);
+    KernelPerfStats by_find = kernel_perf_stats(IntersectionStrategy::by_find);
+    REQUIRE(by_hash.calls == 1);
+    REQUIRE(by_find.calls == 2);
+    REQUIRE(by_find.elements == 2 * (smaller.size() + larger.size()));
+    REQUIRE(kernel_perf_stats(IntersectionStrategy::by_sort).calls == 0);
+
+    // Без доступа к PMU (например, в виртуалке) значения просто отсутствуют.
+    if (kernel_perf_counters_available()) {
+        REQUIRE(by_find.counts.valid[PERF_CYCLES]);
+        REQUIRE(by_find.counts.values[PERF_CYCLES] > 0);
+    } else {
+        for (int e = 0; e < PERF_EVENTS_COUNT; e++) {
+            REQUIRE(by_find.counts.valid[e] == false);
+        }
+    }
+
+    reset_kernel_perf_stats();
+    REQUIRE(kernel_perf_stats(IntersectionStrategy::by_find).calls == 0);
+
+    // Если все счетчики не помещаются на PMU разом, они делятся на группы, и счетчики
+    // процессора все равно остаются настоящими, а не пропадают вместе с кэшевыми.
+    PerfCounterGroup group;
+    if (group.available()) {
+        REQUIRE(group.groups() >= 1);
+        REQUIRE(group.groups() <= PERF_EVENTS_COUNT);
+        group.start();
+        REQUIRE(count_intersection_by_hash(smaller, larger) == 2);
+        PerfCounts counts = group.stop();
+        REQUIRE(counts.valid[PERF_CYCLES]);
+    } else {
+        REQUIRE(group.groups() == 0);
+    }
+}
+
+TEST_CASE("telemetry", "[count_intersection][telemetry]") {
+
+    SECTION("latency histogram buckets") {
+        for (uint64_t value : {0, 1, 3, 4, 7, 8, 12, 1000, 123456789}) {
+            int bucket = LatencyHistogram::bucket(value);
+            REQUIRE(LatencyHistogram::bucket_low(bucket) <= value);
+            // Точность корзины - четверть степени двойки.
+            REQUIRE(value - LatencyHistogram::bucket_low(bucket) <= value / 4);
+            REQUIRE(LatencyHistogram::bucket(LatencyHistogram::bucket_low(bucket)) == bucket);
+        }
+        REQUIRE(LatencyHistogram::bucket(UINT64_MAX) == LatencyHistogram::BUCKETS - 1);
+
+        LatencyHistogram histogram;
+        for (int i = 0; i < 99; i++) {
+            histogram.counts[LatencyHistogram::bucket(100)]++;
+        }
+        histogram.counts[LatencyHistogram::bucket(100000)]++;
+        REQUIRE(histogram.total() == 100);
+        REQUIRE(histogram.percentile(0.5) == LatencyHistogram::bucket_low(LatencyHistogram::bucket(100)));
+        REQUIRE(histogram.percentile(1) == LatencyHistogram::bucket_low(LatencyHistogram::bucket(100000)));
+    }
+
+    SECTION("calls, bytes and latency per strategy") {
+        Telemetry &telemetry = intersection_telemetry();
+        vector<int> smaller = {1, 2, 3};
+        vector<int> larger = {3, 4, 5, 6, 7};
+        IntersectionShape shape = describe_intersection(smaller, larger);
+        int by_find = (int)IntersectionStrategy::by_find;
+        int size_class = telemetry_size_class(smaller.size() + larger.size());
+
+        TelemetrySnapshot before = telemetry.snapshot();
+        REQUIRE(count_intersection_with(IntersectionStrategy::by_find, shape, smaller, larger) == 1);
+        telemetry.set_latency_enabled(true);
+        REQUIRE(count_intersection_with(IntersectionStrategy::by_find, shape, smaller, larger) == 1);
+        telemetry.set_latency_enabled(false);
+        // Шард завершившегося потока не теряется. REQUIRE только в главном потоке.
+        int thread_count = -1;
+        thread([&] {
+            thread_count = count_intersection_with(IntersectionStrategy::by_find, shape, smaller, larger);
+        }).join();
+        REQUIRE(thread_count == 1);
+        TelemetrySnapshot after = telemetry.snapshot();
+
+        REQUIRE(after.calls[by_find] - before.calls[by_find] == 3);
+        REQUIRE(after.bytes[by_find] - before.bytes[by_find] == 3 * 8 * sizeof(int));
+        REQUIRE(after.latency[by_find][size_class].total() - before.latency[by_find][size_class].total() == 1);
+    }
+}
+
+TEST_CASE("count_intersection threshold", "[count_intersection][threshold]") {
+
+    SECTION("threshold on small vectors") {
+        vector<int> smaller = {-3, -2, -1, 0};
+        vector<int> larger = {-1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+
+        REQUIRE(count_intersection_at_least(smaller, larger, 0) == true);
+        REQUIRE(count_intersection_at_least(smaller, larger, 2) == true);
+        REQUIRE(count_intersection_at_least(larger, smaller, 2) == true);
+        REQUIRE(count_intersection_at_least(smaller, larger, 3) == false);
+        // Больше, чем элементов в smaller, общих не бывает.
+        REQUIRE(count_intersection_at_least(smaller, larger, 5) == false);
+        REQUIRE(count_intersection_at_least(larger, smaller, 5) == false);
+        REQUIRE(count_intersection_less_than(smaller, larger, 3) == true);
+        REQUIRE(count_intersection_less_than(smaller, larger, 2) == false);
+
+        REQUIRE(count_intersection_bounded(smaller, larger, 0) == 0);
+        REQUIRE(count_intersection_bounded(smaller, larger, 1) == 1);
+        REQUIRE(count_intersection_bounded(smaller, larger, 2) == 2);
+        REQUIRE(count_intersection_bounded(smaller, larger, 100) == 2);
+
+        REQUIRE(count_intersection_by_find_at_least(smaller, larger, 2) == true);
+        REQUIRE(count_intersection_by_hash_at_least(smaller, larger, 2) == true);
+        REQUIRE(count_intersection_by_find_at_least(smaller, larger, 3) == false);
+        REQUIRE(count_intersection_by_hash_at_least(smaller, larger, 3) == false);
+    }
+
+    SECTION("threshold with empty vector") {
+        vector<int> v1, v2 = {1, 2, 3};
+        REQUIRE(count_intersection_at_least(v1, v2, 0) == true);
+        REQUIRE(count_intersection_at_least(v1, v2, 1) == false);
+        REQUIRE(count_intersection_bounded(v1, v2, 1) == 0);
+    }
+
+    SECTION("threshold stress") {
+        mt19937 gen(0);
+        uniform_int_distribution<int> uid(0, 2000);
+        int number_of_tests = 200;
+        for (int t = 0; t < number_of_tests; t++) {
+            gen.discard(t);
+            vector<int> smaller = generator(gen, uid, t % 2 ? 20 : 300);
+            vector<int> larger = generator(gen, uid, 1000);
+
+            int full = count_intersection(smaller, larger);
+            for (int k : {0, 1, full - 1, full, full + 1, 1001}) {
+                REQUIRE(count_intersection_bounded(smaller, larger, k) == min(max(k, 0), full));
+                REQUIRE(count_intersection_at_least(smaller, larger, k) == (full >= k));
+                REQUIRE(count_intersection_less_than(larger, smaller, k) == (full < k));
+                REQUIRE(count_intersection_by_find_bounded(smaller, larger, max(k, 1)) == min(max(k, 1), full));
+                REQUIRE(count_intersection_by_hash_bounded(smaller, larger, max(k, 1)) == min(max(k, 1), full));
+                REQUIRE(count_intersection_by_find_at_least(smaller, larger, k) == (full >= k));
+                REQUIRE(count_intersection_by_hash_at_least(smaller, larger, k) == (full >= k));
+            }
+        }
+    }
+}
+
+TEST_CASE("int set file", "[int_set_file]") {
+    // Тесты запускаются из корня репозитория, out создает make.
+    const string path = "out/test_int_set.bin";
+
+    SECTION("sorted round trip with index") {
+        vector<int> values(1000);
+        iota(begin(values), end(values), -500);
+        for (auto &e : values) {
+            e *= 3;
+        }
+        REQUIRE(write_int_set_file(path, values));
+
+        MappedIntSet mapped;
+        REQUIRE(mapped.open(path));
+        REQUIRE(mapped.size() == values.size());
+        REQUIRE(mapped.sorted());
+        REQUIRE(mapped.has_index());
+        REQUIRE(mapped.min() == values.front());
+        REQUIRE(mapped.max() == values.back());
+        REQUIRE(mapped.index().size() == (values.size() + INT_SET_INDEX_STRIDE - 1) / INT_SET_INDEX_STRIDE);
+        REQUIRE(reinterpret_cast<uintptr_t>(mapped.view().data()) % INT_SET_FILE_ALIGNMENT == 0);
+        REQUIRE(mapped.view().known_sorted());
+        REQUIRE(equal(begin(values), end(values), begin(mapped.view())));
+
+        for (int value = -1600; value <= 1600; value++) {
+            REQUIRE(mapped.contains(value) == (value % 3 == 0 && value >= -1500 && value < 1500));
+        }
+    }
+
+    SECTION("unsorted round trip") {
+        vector<int> values = {5, -1, 7, 3, 3};
+        REQUIRE(write_int_set_file(path, values));
+
+        MappedIntSet mapped;
+        REQUIRE(mapped.open(path));
+        REQUIRE(!mapped.sorted());
+        REQUIRE(!mapped.has_index());
+        REQUIRE(mapped.min() == -1);
+        REQUIRE(mapped.max() == 7);
+        REQUIRE(mapped.contains(3));
+        REQUIRE(!mapped.contains(4));
+
+        // Перемещение передает владение отображением.
+        MappedIntSet moved = move(mapped);
+        REQUIRE(!mapped.is_open());
+        REQUIRE(equal(begin(values), end(values), begin(moved.view())));
+    }
+
+    SECTION("empty set") {
+        REQUIRE(write_int_set_file(path, vector<int>()));
+        MappedIntSet mapped;
+        REQUIRE(mapped.open(path));
+        REQUIRE(mapped.view().empty());
+        REQUIRE(!mapped.contains(0));
+    }
+
+    SECTION("broken files") {
+        MappedIntSet mapped;
+        REQUIRE(!mapped.open("out/no_such_file.bin"));
+        REQUIRE(!mapped.error().empty());
+
+        vector<int> values = {1, 2, 3};
+        REQUIRE(write_int_set_file(path, values));
+        FILE *file = fopen(path.c_str(), "r+b");
+        REQUIRE(file != nullptr);
+        fputc('X', file);
+        fclose(file);
+        REQUIRE(!mapped.open(path));
+        REQUIRE(mapped.error().find("not an int set file") != string::npos);
+
+        // count больше, чем помещается в файле.
+        REQUIRE(write_int_set_file(path, values));
+        file = fopen(path.c_str(), "r+b");
+        uint64_t count = 1000;
+        fseek(file, offsetof(IntSetFileHeader, count), SEEK_SET);
+        fwrite(&count, sizeof(count), 1, file);
+        fclose(file);
+        REQUIRE(!mapped.open(path));
+        REQUIRE(!mapped.is_open());
+        // load_int_set сообщает ошибку бинарного формата, а не пробует разобрать файл как текст.
+        LoadedIntSet loaded;
+        string error;
+        REQUIRE(!load_int_set(path, loaded, &error));
+        REQUIRE(error.find("payload is out of file bounds") != string::npos);
+
+        // Флаг SORTED у неотсортированных данных: алгоритмы для отсортированных массивов
+        // посчитали бы неверно, поэтому файл не открывается.
+        vector<int> unsorted = {5, 1, 3};
+        REQUIRE(write_int_set_file(path, unsorted));
+        file = fopen(path.c_str(), "r+b");
+        uint32_t flags = INT_SET_FILE_SORTED;
+        fseek(file, offsetof(IntSetFileHeader, flags), SEEK_SET);
+        fwrite(&flags, sizeof(flags), 1, file);
+        fclose(file);
+        REQUIRE(!mapped.open(path));
+        REQUIRE(mapped.error().find("not sorted") != string::npos);
+
+        // max меньше настоящего: contains(5) отсек бы существующее значение.
+        REQUIRE(write_int_set_file(path, unsorted));
+        file = fopen(path.c_str(), "r+b");
+        int32_t max = 3;
+        fseek(file, offsetof(IntSetFileHeader, max), SEEK_SET);
+        fwrite(&max, sizeof(max), 1, file);
+        fclose(file);
+        REQUIRE(!mapped.open(path));
+        REQUIRE(mapped.error().find("min/max") != string::npos);
+
+        // Индекс не совпадает с данными.
+        vector<int> many(1000);
+        iota(begin(many), end(many), 0);
+        REQUIRE(write_int_set_file(path, many));
+        file = fopen(path.c_str(), "r+b");
+        int32_t fence = -1;
+        fseek(file, align_up(INT_SET_FILE_ALIGNMENT + many.size() * sizeof(int), INT_SET_FILE_ALIGNMENT) + sizeof(int),
+              SEEK_SET);
+        fwrite(&fence, sizeof(fence), 1, file);
+        fclose(file);
+        REQUIRE(!mapped.open(path));
+        REQUIRE(mapped.error().find("index does not match") != string::npos);
+    }
+
+    SECTION("mapped views work with every strategy") {
+        mt19937 gen(0);
+        uniform_int_distribution<int> uid(0, 5000);
+        vector<int> smaller = generator(gen, uid, 300);
+        vector<int> larger = generator(mt19937(1), uid, 3000);
+        sort(begin(larger), end(larger));
+        int expected = count_intersection_by_hash(smaller, larger);
+
+        const string smaller_path = "out/test_int_set_smaller.bin";
+        REQUIRE(write_int_set_file(smaller_path, smaller));
+        REQUIRE(write_int_set_file(path, larger));
+        MappedIntSet mapped_smaller, mapped_larger;
+        REQUIRE(mapped_smaller.open(smaller_path));
+        REQUIRE(mapped_larger.open(path));
+
+        IntArrayView a = mapped_smaller.view(), b = mapped_larger.view();
+        IntersectionShape shape = describe_intersection(a, b);
+        REQUIRE(shape.larger_sorted);
+        REQUIRE(count_intersection(a, b) == expected);
+        REQUIRE(count_intersection(b, a) == expected);
+        for (int i = 0; i < INTERSECTION_STRATEGIES_COUNT; i++) {
+            auto strategy = (IntersectionStrategy)i;
+            if (intersection_cost_model().cost(strategy, shape) != HUGE_VAL) {
+                REQUIRE(count_intersection_with(strategy, shape, a, b) == expected);
+            }
+        }
+    }
+}
+
+TEST_CASE("count_intersection stream", "[count_intersection][stream]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(0, 20000);
+    vector<int> smaller = generator(gen, uid, 500);
+    vector<int> larger = generator(mt19937(1), uid, 10000);
+    uint64_t expected = count_intersection_by_hash(smaller, larger);
+
+    SECTION("file in chunks of different sizes") {
+        const string path = "out/test_stream.bin";
+        FILE *file = fopen(path.c_str(), "wb");
+        REQUIRE(file != nullptr);
+        fwrite(larger.data(), sizeof(int), larger.size(), file);
+        fclose(file);
+
+        for (size_t chunk : {1, 7, 1000, 10000, 1 << 20}) {
+            uint64_t count = UINT64_MAX;
+            REQUIRE(count_intersection_stream(smaller, path, count, nullptr, chunk));
+            REQUIRE(count == expected);
+        }
+        uint64_t count = UINT64_MAX;
+        string error;
+        REQUIRE(!count_intersection_stream(smaller, "out/no_such_stream.bin", count, &error));
+        REQUIRE(!error.empty());
+    }
+
+    SECTION("pipe with short writes") {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        // Пишем кусками по 7 байт, так что числа разрываются между read.
+        thread writer([&] {
+            const char *bytes = reinterpret_cast<const char *>(larger.data());
+            size_t total = larger.size() * sizeof(int);
+            // REQUIRE из другого потока Catch не поддерживает, ошибку записи заметит читатель.
+            for (size_t done = 0; done < total; done += 7) {
+                if (write(fds[1], bytes + done, min((size_t)7, total - done)) <= 0) {
+                    break;
+                }
+            }
+            close(fds[1]);
+        });
+        uint64_t count = UINT64_MAX;
+        REQUIRE(count_intersection_stream(smaller, fds[0], count, nullptr, 100));
+        writer.join();
+        close(fds[0]);
+        REQUIRE(count == expected);
+    }
+
+    SECTION("truncated stream") {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        REQUIRE(write(fds[1], larger.data(), 4 * sizeof(int) + 2) > 0);
+        close(fds[1]);
+        uint64_t count = UINT64_MAX;
+        string error;
+        REQUIRE(!count_intersection_stream(smaller, fds[0], count, &error, 3));
+        REQUIRE(!error.empty());
+        close(fds[0]);
+    }
+}
+
+TEST_CASE("compressed sorted lists", "[count_intersection][compressed]") {
+
+    SECTION("round trip") {
+        mt19937 gen(0);
+        for (size_t size : {0, 1, 3, 4, 5, 127, 128, 129, 1000}) {
+            for (int max_value : {1000, 1 << 20, INT_MAX}) {
+                uniform_int_distribution<int> uid(-max_value, max_value);
+                set<int> values_set;
+                while (values_set.size() < size) {
+                    values_set.insert(uid(gen));
+                }
+                vector<int> values(begin(values_set), end(values_set));
+
+                CompressedSortedList list(values);
+                REQUIRE(list.size() == size);
+                REQUIRE(list.decode() == values);
+                int buffer[COMPRESSED_BLOCK_SIZE];
+                for (size_t block = 0; block < list.blocks(); block++) {
+                    size_t count = list.decode_block_scalar(block, buffer);
+                    REQUIRE(equal(buffer, buffer + count, begin(values) + block * COMPRESSED_BLOCK_SIZE));
+                }
+            }
+        }
+
+        vector<int> extremes = {INT_MIN, INT_MIN + 1, -1, 0, 1, INT_MAX - 1, INT_MAX};
+        REQUIRE(CompressedSortedList(extremes).decode() == extremes);
+
+        // Плотные значения занимают около 1.4 байта на число вместе с управляющими байтами и skip pointer'ами.
+        vector<int> dense(10000);
+        iota(begin(dense), end(dense), 0);
+        REQUIRE(CompressedSortedList(dense).compressed_bytes() < dense.size() * sizeof(int) / 2);
+    }
+
+    SECTION("intersection matches hash") {
+        mt19937 gen(0);
+        uniform_int_distribution<int> uid(0, 100000);
+        for (int t = 0; t < 50; t++) {
+            gen.discard(t);
+            vector<int> smaller = generator(gen, uid, t % 2 ? 50 : 3000);
+            vector<int> larger = generator(mt19937(t), uid, 20000);
+            int expected = count_intersection_by_hash(smaller, larger);
+
+            sort(begin(larger), end(larger));
+            CompressedSortedList compressed_larger(larger);
+            REQUIRE(count_intersection_compressed(smaller, compressed_larger) == expected);
+
+            sort(begin(smaller), end(smaller));
+            CompressedSortedList compressed_smaller(smaller);
+            REQUIRE(count_intersection_compressed(compressed_smaller, compressed_larger) == expected);
+            REQUIRE(count_intersection_compressed(compressed_larger, compressed_smaller) == expected);
+        }
+    }
+
+    SECTION("skip pointers avoid decoding") {
+        vector<int> low(1000), high(1000), mixed = {5, 500000};
+        iota(begin(low), end(low), 0);
+        iota(begin(high), end(high), 1000000);
+        CompressedSortedList compressed_low(low), compressed_high(high);
+
+        size_t decoded = 1;
+        REQUIRE(count_intersection_compressed(compressed_low, compressed_high, &decoded) == 0);
+        REQUIRE(decoded == 0);
+        REQUIRE(count_intersection_compressed(mixed, compressed_low, &decoded) == 1);
+        REQUIRE(decoded == 1);
+    }
+}
+
+TEST_CASE("count_intersection external", "[count_intersection][external]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(-1000000, 1000000);
+    vector<int> a = generator(gen, uid, 100000);
+    vector<int> b = generator(mt19937(1), uid, 150000);
+    int expected = count_intersection_by_hash(a, b);
+
+    const string path_a = "out/test_external_a.bin", path_b = "out/test_external_b.bin";
+    for (auto file : {make_pair(path_a, &a), make_pair(path_b, &b)}) {
+        FILE *out = fopen(file.first.c_str(), "wb");
+        REQUIRE(out != nullptr);
+        fwrite(file.second->data(), sizeof(int), file.second->size(), out);
+        fclose(out);
+    }
+
+    ExternalIntersectionOptions options;
+    options.temp_dir = "out";
+
+    SECTION("partitions from memory budget") {
+        for (int threads : {1, 3}) {
+            options.threads = threads;
+            // 100000 элементов по 10 байт на 256 КБ - несколько частей на поток.
+            options.memory_budget = 256 << 10;
+            int fd = open(path_a.c_str(), O_RDONLY);
+            int bits = external_partition_bits(fd, -1, options, threads);
+            close(fd);
+            REQUIRE(bits >= 2);
+            uint64_t count = 0;
+            REQUIRE(count_intersection_external(path_a, path_b, count, options));
+            REQUIRE(count == (uint64_t)expected);
+        }
+    }
+
+    SECTION("more partitions than one level holds") {
+        for (int threads : {1, 3}) {
+            options.threads = threads;
+            // 100000 элементов по 10 байт на 3 КБ на поток - больше 256 частей, пары делятся повторно.
+            options.memory_budget = threads * (3 << 10);
+            int fd = open(path_a.c_str(), O_RDONLY);
+            REQUIRE(external_partition_bits(fd, -1, options, threads) > EXTERNAL_MAX_PARTITION_BITS);
+            close(fd);
+            uint64_t count = 0;
+            ExternalIntersectionStats stats;
+            REQUIRE(count_intersection_external(path_a, path_b, count, options, nullptr, &stats));
+            REQUIRE(count == (uint64_t)expected);
+            REQUIRE(stats.repartitioned > 0);
+            REQUIRE(stats.largest_partition * EXTERNAL_BYTES_PER_ELEMENT <= options.memory_budget / threads);
+        }
+    }
+
+    SECTION("explicit partitions") {
+        for (size_t partitions : {1, 5, 1000}) {
+            options.partitions = partitions;
+            uint64_t count = 0;
+            ExternalIntersectionStats stats;
+            REQUIRE(count_intersection_external(path_b, path_a, count, options, nullptr, &stats));
+            REQUIRE(count == (uint64_t)expected);
+            // 1000 частей не помещаются на один уровень, каждая пара первого уровня делится еще раз.
+            REQUIRE((stats.repartitioned > 0) == (partitions > EXTERNAL_MAX_PARTITIONS));
+        }
+    }
+
+    SECTION("errors") {
+        uint64_t count = 0;
+        string error;
+        REQUIRE(!count_intersection_external(path_a, "out/no_such_input.bin", count, options, &error));
+        REQUIRE(error.find("no_such_input") != string::npos);
+
+        options.temp_dir = "out/no_such_dir";
+        error.clear();
+        REQUIRE(!count_intersection_external(path_a, path_b, count, options, &error));
+        REQUIRE(!error.empty());
+    }
+}
+
+TEST_CASE("parse_int_text", "[parse_int_text]") {
+
+    SECTION("formats") {
+        string text = "1\n-2\r\n  30\t12345678 -123456789\n2147483647\n-2147483648\n0\n-0";
+        vector<int> values;
+        REQUIRE(parse_int_text(text.data(), text.data() + text.size(), values));
+        REQUIRE(values == vector<int>({1, -2, 30, 12345678, -123456789, INT_MAX, INT_MIN, 0, 0}));
+
+        // Ведущие нули не входят в ограничение на длину числа.
+        values.clear();
+        string zeros = "00000000001 -000000000002147483648 00000000000000 0002147483647 007";
+        REQUIRE(parse_int_text(zeros.data(), zeros.data() + zeros.size(), values));
+        REQUIRE(values == vector<int>({1, INT_MIN, 0, INT_MAX, 7}));
+
+        values.clear();
+        string empty = " \n\n";
+        REQUIRE(parse_int_text(empty.data(), empty.data() + empty.size(), values));
+        REQUIRE(values.empty());
+    }
+
+    SECTION("errors") {
+        for (string text : {"12a", "2147483648", "-2147483649", "12345678901", "0012345678901", "00a", "1 - 2", "abc", "-"}) {
+            vector<int> values;
+            string error;
+            REQUIRE(!parse_int_text(text.data(), text.data() + text.size(), values, &error));
+            REQUIRE(error.find("offset") == 0);
+        }
+    }
+
+    SECTION("random numbers match strtol") {
+        mt19937 gen(0);
+        uniform_int_distribution<int> uid(INT_MIN, INT_MAX);
+        uniform_int_distribution<int> digits(0, 9);
+        string text;
+        vector<int> expected;
+        for (int i = 0; i < 10000; i++) {
+            // Разные длины, чтобы проверить и восьмизначный путь, и обычный.
+            int value = uid(gen) / (1 << digits(gen) * 3 % 31);
+            expected.push_back(value);
+            text += to_string(value) + (i % 3 ? "\n" : " ");
+        }
+        vector<int> values;
+        REQUIRE(parse_int_text(text.data(), text.data() + text.size(), values));
+        REQUIRE(values == expected);
+    }
+}
+
+TEST_CASE("intersection executor", "[executor]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(-1000000000, 1000000000);
+
+    // Разброс размеров на несколько порядков, плюс пустые и отсортированные входы.
+    // Все массивы - случайные подмножества одного, чтобы пересечения были непустыми,
+    // а разреженные значения - чтобы модель выбирала хеш-таблицу и запросы делились.
+    vector<int> base = generator(gen, uid, 60000);
+    vector<vector<int>> arrays;
+    for (int size : {0, 5, 50, 300, 2000, 20000, 60000}) {
+        shuffle(begin(base), end(base), gen);
+        arrays.emplace_back(begin(base), begin(base) + size);
+    }
+    arrays.push_back(arrays.back());
+    sort(begin(arrays.back()), end(arrays.back()));
+
+    vector<pair<IntArrayView, IntArrayView>> queries;
+    vector<int> expected;
+    for (size_t i = 0; i < arrays.size(); i++) {
+        for (size_t j = 0; j < arrays.size(); j++) {
+            queries.emplace_back(arrays[i], arrays[j]);
+            expected.push_back(count_intersection(arrays[i], arrays[j]));
+        }
+    }
+
+    IntersectionExecutorOptions options;
+    options.threads = 4;
+    // Маленькие пороги, чтобы деление на части работало и на тестовых размерах.
+    options.split_elements = 1000;
+    options.probe_chunk = 777;
+    IntersectionExecutor executor(options);
+    REQUIRE(executor.threads() == 4);
+
+    SECTION("same answers as count_intersection") {
+        for (int round = 0; round < 3; round++) {
+            REQUIRE(executor.count_batch(queries) == expected);
+        }
+        REQUIRE(executor.split_queries() > 0);
+    }
+
+    SECTION("empty batch") {
+        REQUIRE(executor.count_batch({}).empty());
+        REQUIRE(executor.count_batch(queries) == expected);
+    }
+
+    SECTION("batches from several threads") {
+        vector<int> ok(3);
+        vector<thread> clients;
+        for (int c = 0; c < 3; c++) {
+            clients.emplace_back([&, c] {
+                ok[c] = executor.count_batch(queries) == expected;
+            });
+        }
+        for (auto &client : clients) {
+            client.join();
+        }
+        REQUIRE(ok == vector<int>(3, 1));
+    }
+
+    SECTION("futures") {
+        vector<future<int>> answers;
+        for (auto &q : queries) {
+            answers.push_back(executor.submit(q.first, q.second));
+        }
+        for (size_t i = 0; i < answers.size(); i++) {
+            REQUIRE(answers[i].get() == expected[i]);
+        }
+        REQUIRE(submit_intersection(queries.back().first, queries.back().second).get() == expected.back());
+    }
+
+    SECTION("completion queue") {
+        IntersectionCompletionQueue queue;
+        REQUIRE(queue.fd() >= 0);
+        for (size_t i = 0; i < queries.size(); i++) {
+            executor.submit(queries[i].first, queries[i].second, queue, i);
+        }
+        // Как в цикле событий: ждем готовности fd и забираем все, что успело прийти.
+        vector<IntersectionCompletionQueue::Completion> completions;
+        while (completions.size() < queries.size()) {
+            pollfd ready = {queue.fd(), POLLIN, 0};
+            REQUIRE(poll(&ready, 1, 10000) == 1);
+            REQUIRE(queue.pop_all(completions) > 0);
+        }
+        REQUIRE(completions.size() == queries.size());
+        vector<int> results(queries.size(), -1);
+        for (auto &completion : completions) {
+            results[completion.tag] = completion.count;
+        }
+        REQUIRE(results == expected);
+        // Очередь пуста - fd больше не читаем.
+        pollfd ready = {queue.fd(), POLLIN, 0};
+        REQUIRE(poll(&ready, 1, 0) == 0);
+
+        executor.submit(queries[1].first, queries[1].second, queue, 77);
+        IntersectionCompletionQueue::Completion completion = queue.pop();
+        REQUIRE(completion.tag == 77);
+        REQUIRE(completion.count == expected[1]);
+    }
+
+    SECTION("callbacks and shutdown") {
+        atomic<int> total(0);
+        {
+            IntersectionExecutor local(options);
+            for (auto &q : queries) {
+                local.submit(q.first, q.second, [&](int count) {
+                    total += count;
+                });
+            }
+            // Деструктор ждет все отправленные запросы.
+        }
+        REQUIRE(total == accumulate(begin(expected), end(expected), 0));
+    }
+
+    SECTION("exceptions") {
+        // Исключение из callback не роняет поток пула и не оставляет запрос в _in_flight.
+        atomic<int> errors(0);
+        {
+            IntersectionExecutor local(options);
+            for (auto &q : queries) {
+                local.submit(q.first, q.second, [](int) {
+                    throw runtime_error("callback failed");
+                });
+            }
+            for (auto &q : queries) {
+                local.submit(q.first, q.second, IntersectionCallback([&](int, exception_ptr error) {
+                    errors += error != nullptr;
+                }));
+            }
+            REQUIRE(local.count_batch(queries) == expected);
+            REQUIRE(local.submit(queries[0].first, queries[0].second).get() == expected[0]);
+            // Callback'и из первого цикла могли еще не отработать в других потоках.
+            for (int wait = 0; wait < 10000 && local.failed_callbacks() < queries.size(); wait++) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            REQUIRE(local.failed_callbacks() == queries.size());
+        }
+        REQUIRE(errors == 0);
+    }
+}
+
+TEST_CASE("intersection server", "[intersection_server]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> wide(INT_MIN / 2, INT_MAX / 2), narrow(0, 30000);
+    vector<int> sparse = generator(gen, wide, 5000);
+    vector<int> dense = generator(mt19937(1), narrow, 20000);
+    vector<int> probe = generator(mt19937(2), narrow, 3000);
+    probe.insert(end(probe), begin(sparse), begin(sparse) + 100);
+
+    IntersectionServer server;
+    server.add_set("sparse", sparse);
+    server.add_set("dense", dense);
+    server.add_set("empty", vector<int>());
+    REQUIRE(!server.find_set("sparse")->has_bitmap());
+    REQUIRE(server.find_set("dense")->has_bitmap());
+
+    SECTION("direct calls") {
+        REQUIRE(server.intersect("dense", probe) == count_intersection_by_hash(dense, probe));
+        REQUIRE(server.intersect("sparse", probe) == 100);
+        REQUIRE(server.intersect("sparse", "dense") == count_intersection_by_hash(sparse, dense));
+        REQUIRE(server.intersect("empty", "dense") == 0);
+        REQUIRE(server.intersect("missing", "dense") == INTERSECTION_UNKNOWN_SET);
+    }
+
+    SECTION("requests split at any byte") {
+        // Целый запрос и запрос без имени; серверу они приходят по одному байту.
+        vector<char> requests;
+        append_raw(requests, (uint32_t)(1 + 2 + 6 + 2 + 5));
+        append_raw(requests, (uint8_t)INTERSECT_SETS);
+        append_raw(requests, (uint16_t)6);
+        requests.insert(end(requests), {'s', 'p', 'a', 'r', 's', 'e'});
+        append_raw(requests, (uint16_t)5);
+        requests.insert(end(requests), {'d', 'e', 'n', 's', 'e'});
+        append_raw(requests, (uint32_t)1);
+        append_raw(requests, (uint8_t)INTERSECT_ARRAY);
+
+        vector<char> responses;
+        size_t used = 0;
+        for (size_t size = 1; size <= requests.size(); size++) {
+            used += server.handle_requests(requests.data() + used, size - used, responses);
+        }
+        REQUIRE(used == requests.size());
+        REQUIRE(responses.size() == 2 * sizeof(int));
+        int results[2];
+        memcpy(results, responses.data(), sizeof(results));
+        REQUIRE(results[0] == count_intersection_by_hash(sparse, dense));
+        REQUIRE(results[1] == INTERSECTION_BAD_REQUEST);
+
+        append_raw(requests, (uint32_t)MAX_INTERSECTION_REQUEST_BYTES + 1);
+        REQUIRE(server.handle_requests(requests.data(), requests.size(), responses) == SIZE_MAX);
+    }
+
+    SECTION("pipelined requests over socket") {
+        const string path = "out/test_server.sock";
+        REQUIRE(server.listen(path));
+        thread serving([&] { server.serve(); });
+
+        IntersectionClient client;
+        REQUIRE(client.connect(path));
+        client.queue_intersect("sparse", "dense");
+        client.queue_intersect("dense", probe);
+        client.queue_intersect("missing", probe);
+        client.queue_intersect("sparse", probe);
+        client.queue_intersect("dense", vector<int>());
+        vector<int> results;
+        REQUIRE(client.flush(results));
+        REQUIRE(results == vector<int>({count_intersection_by_hash(sparse, dense),
+                                        count_intersection_by_hash(dense, probe), INTERSECTION_UNKNOWN_SET, 100, 0}));
+
+        // Запрос больше буфера чтения сервера приходит несколькими кусками.
+        REQUIRE(client.intersect("dense", sparse) == count_intersection_by_hash(sparse, dense));
+        vector<int> big(100000);
+        iota(begin(big), end(big), 0);
+        REQUIRE(client.intersect("dense", big) == (int)dense.size());
+
+        server.stop();
+        serving.join();
+        REQUIRE(client.intersect("dense", "sparse") == INTERSECTION_IO_ERROR);
+    }
+
+    SECTION("threads of closed connections are reaped") {
+        const string path = "out/test_server.sock";
+        REQUIRE(server.listen(path));
+        thread serving([&] { server.serve(); });
+
+        for (int i = 0; i < 20; i++) {
+            {
+                IntersectionClient client;
+                REQUIRE(client.connect(path));
+                REQUIRE(client.intersect("sparse", probe) == 100);
+            }
+            // Ждем, пока сервер увидит закрытие: тогда следующий accept соберет поток.
+            while (server.connections() != 0) {
+                this_thread::yield();
+            }
+        }
+        IntersectionClient client;
+        REQUIRE(client.connect(path));
+        REQUIRE(client.intersect("sparse", probe) == 100);
+        REQUIRE(server.connection_threads() == 1);
+
+        server.stop();
+        serving.join();
+        REQUIRE(server.connection_threads() == 0);
+    }
+}
+
+TEST_CASE("FastIntHashSet snapshot", "[FastIntHashSet][snapshot]") {
+    const string path = "out/test_hash_set.snapshot";
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(INT_MIN, INT_MAX);
+    vector<int> values = generator(gen, uid, 10000);
+    vector<int> others = generator(mt19937(1), uid, 10000);
+
+    // Несколько поколений, чтобы в таблице остались устаревшие метки.
+    FastIntHashSet hash_set(2 * values.size());
+    for (int round = 0; round < 3; round++) {
+        hash_set.clear();
+        for (auto e : round < 2 ? others : values) {
+            hash_set.add(e);
+        }
+    }
+    REQUIRE(save_hash_set_snapshot(hash_set, path));
+
+    SECTION("probe without rebuild") {
+        MappedHashSet mapped;
+        REQUIRE(mapped.open(path));
+        REQUIRE(mapped.set().size() == values.size());
+        REQUIRE(mapped.set().capacity() == hash_set.capacity());
+        for (auto e : values) {
+            REQUIRE(mapped.set().contains(e));
+        }
+        for (auto e : others) {
+            REQUIRE(mapped.set().contains(e) == hash_set.contains(e));
+        }
+    }
+
+    SECTION("changes stay in the process") {
+        MappedHashSet mapped;
+        REQUIRE(mapped.open(path));
+        int missing = 0;
+        while (hash_set.contains(missing)) {
+            ++missing;
+        }
+        mapped.set().add(missing);
+        REQUIRE(mapped.set().contains(missing));
+        mapped.set().clear();
+        REQUIRE(!mapped.set().contains(values[0]));
+
+        MappedHashSet again;
+        REQUIRE(again.open(path));
+        REQUIRE(again.set().contains(values[0]));
+        REQUIRE(!again.set().contains(missing));
+    }
+
+    SECTION("broken snapshots") {
+        MappedHashSet mapped;
+        REQUIRE(!mapped.open("out/no_such.snapshot"));
+        REQUIRE(!mapped.is_open());
+
+        FILE *file = fopen(path.c_str(), "r+b");
+        REQUIRE(file != nullptr);
+        uint32_t hash_function = 7;
+        fseek(file, offsetof(HashSetSnapshotHeader, hash_function), SEEK_SET);
+        fwrite(&hash_function, sizeof(hash_function), 1, file);
+        fclose(file);
+        REQUIRE(!mapped.open(path));
+        REQUIRE(mapped.error().find("hash function") != string::npos);
+
+        REQUIRE(write_int_set_file(path, values));
+        REQUIRE(!mapped.open(path));
+        REQUIRE(mapped.error().find("not a hash set snapshot") != string::npos);
+    }
+}
+
+TEST_CASE("PerfectHashSet", "[PerfectHashSet]") {
+    mt19937 gen(0);
+    uniform_int_distribution<int> uid(INT_MIN, INT_MAX);
+
+    SECTION("every key gets its own slot") {
+        for (int size : {0, 1, 2, 63, 1000, 100000}) {
+            gen.discard(size);
+            vector<int> values = generator(gen, uid, size);
+            PerfectHashSet index(values);
+            REQUIRE(index.built());
+            REQUIRE(index.size() == values.size());
+            vector<bool> used(values.size());
+            for (auto e : values) {
+                size_t i = index.index(e);
+                REQUIRE(i < values.size());
+                REQUIRE(!used[i]);
+                used[i] = true;
+                REQUIRE(index.keys()[i] == e);
+            }
+            // 4 байта ключа и около полубайта на пилоты и перенос.
+            REQUIRE(index.memory_bytes() <= values.size() * 4.6 + 64);
+        }
+    }
+
+    SECTION("misses") {
+        vector<int> values = generator(gen, uid, 20000);
+        PerfectHashSet index(IntArrayView(values.data(), 10000));
+        for (size_t i = 0; i < values.size(); i++) {
+            REQUIRE(index.contains(values[i]) == (i < 10000));
+        }
+        vector<int> larger = generator(mt19937(1), uid, 30000);
+        larger.insert(end(larger), begin(values), begin(values) + 5000);
+        REQUIRE(index.count_in(larger) == count_intersection_by_hash(IntArrayView(values.data(), 10000), larger));
+    }
+
+    SECTION("duplicates and extreme values") {
+        vector<int> values = {INT_MIN, INT_MAX, 0, -1, 5, 5, 5, INT_MIN};
+        PerfectHashSet index(values);
+        REQUIRE(index.size() == 5);
+        for (auto e : values) {
+            REQUIRE(index.contains(e));
+        }
+        REQUIRE(!index.contains(1));
+        REQUIRE(!index.contains(INT_MAX - 1));
+    }
+
+    SECTION("failed build is visible") {
+        vector<int> values = {1, 2, 3};
+        // Ни одного зерна: построить нельзя, и это видно.
+        PerfectHashSet index(values, 0);
+        REQUIRE(!index.built());
+        REQUIRE(index.size() == 0);
+        REQUIRE(PerfectHashSet(vector<int>()).built());
+    }
+}
+
+// Проверка скорости. Скрытый тест, запускать так: ./out/vk_db_count_intersection_test "[speed]"
+
+// Медиана времени в наносекундах после нескольких прогревочных запусков.
+template <class Function>
+double median_ns(Function function, int warm_up, int repetitions) {
+    for (int r = 0; r < warm_up; r++) {
+        measure_min_ns(function, 1);
+    }
+    vector<double> times(repetitions);
+    for (auto &time : times) {
+        time = measure_min_ns(function, 1);
+    }
+    nth_element(begin(times), begin(times) + repetitions / 2, end(times));
+    return times[repetitions / 2];
+}
+
+TEST_CASE("speed test", "[!hide][speed]") {
+
+    mt19937 gen(0);
+    const int MAX = 1e9;
+    const int LARGER_SIZE = 10000;
+    const int WARM_UP = 5;
+    const int REPETITIONS = 51;
+    uniform_int_distribution<int> uid(-MAX, MAX);
+
+    // Граница между by_find и by_hash по текущей модели. Проверяем не саму границу
+    // (около нее алгоритмы почти равны), а точки в 4 раза левее и правее.
+    // До MAX_FIXED_FIND_SIZE модель считает by_find ядрами фиксированного размера,
+    // поэтому и замеряем by_find так, как его запускает count_intersection_with.
+    const IntersectionCostModel &model = intersection_cost_model();
+    auto shape_of = [&](size_t smaller_size) {
+        IntersectionShape shape;
+        shape.smaller_size = smaller_size;
+        shape.larger_size = LARGER_SIZE;
+        shape.smaller_span = UINT32_MAX;
+        return shape;
+    };
+    size_t crossover = 1;
+    while (model.cost(IntersectionStrategy::by_find, shape_of(crossover))
+           <= model.cost(IntersectionStrategy::by_hash, shape_of(crossover))) {
+        crossover++;
+    }
+    INFO("by_find / by_hash crossover " << crossover);
+    REQUIRE(crossover >= 4);
+    REQUIRE(crossover * 4 <= LARGER_SIZE);
+
+    vector<int> larger = generator(gen, uid, LARGER_SIZE);
+    auto by_find = [&](const vector<int> &smaller) {
+        return count_intersection_with(IntersectionStrategy::by_find, shape_of(smaller.size()), smaller, larger);
+    };
+
+    SECTION("by_find wins below the crossover") {
+        vector<int> smaller = generator(mt19937(1), uid, crossover / 4);
+
+        double time_find = median_ns([&] { return by_find(smaller); }, WARM_UP, REPETITIONS);
+        double time_hash = median_ns([&] { return count_intersection_by_hash(smaller, larger); }, WARM_UP, REPETITIONS);
+        double time_sort = median_ns([&] { return count_intersection_by_sort(smaller, larger); }, WARM_UP, REPETITIONS);
+
+        CHECK(time_find < time_hash);
+        CHECK(time_find < time_sort);
+    }
+
+    SECTION("by_hash wins above the crossover") {
+        vector<int> smaller = generator(mt19937(1), uid, crossover * 4);
+
+        double time_find = median_ns([&] { return by_find(smaller); }, WARM_UP, REPETITIONS);
+        double time_hash = median_ns([&] { return count_intersection_by_hash(smaller, larger); }, WARM_UP, REPETITIONS);
+        double time_sort = median_ns([&] { return count_intersection_by_sort(smaller, larger); }, WARM_UP, REPETITIONS);
+
+        CHECK(time_hash < time_find);
+        CHECK(time_hash < time_sort);
+    }
+
+    SECTION("count_intersection is close to the best strategy") {
+        for (size_t size : {crossover / 4, crossover * 4}) {
+            vector<int> smaller = generator(mt19937(1), uid, size);
+
+            double time_main = median_ns([&] { return count_intersection(smaller, larger); }, WARM_UP, REPETITIONS);
+            double time_find = median_ns([&] { return by_find(smaller); }, WARM_UP, REPETITIONS);
+            double time_hash = median_ns([&] { return count_intersection_by_hash(smaller, larger); }, WARM_UP, REPETITIONS);
+
+            INFO("smaller size " << size);
+            // Запас на проход describe_intersection и шум.
+            CHECK(time_main < 1.5 * min(time_find, time_hash));
+        }
+    }
+}
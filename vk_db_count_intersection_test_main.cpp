@@ -0,0 +1,4 @@
+// main для тестов. Catch2 собирается отдельно и один раз, чтобы правка тестов
+// не пересобирала весь catch.hpp.
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"